@@ -5,10 +5,9 @@
 namespace Example {
 	static int Lua_ExampleObject_New(lutok::state& state){
 		try{
-			ExampleObject * object = new ExampleObject();
-
 			LuaExampleObject & wrapper = LOBJECT_INSTANCE(LuaExampleObject);
-			wrapper.push(object);
+			//the object is constructed directly inside Lua userdata
+			wrapper.emplace(state);
 			return 1;
 		}catch(std::bad_alloc e){
 			state.error("Cannot allocate memory");
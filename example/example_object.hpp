@@ -24,8 +24,8 @@ namespace Example {
 		LOBJECT_DEFINE_CLASS(LuaExampleObject, ExampleObject *, "ExampleObject type") {
 			LOBJECT_ADD_OPERATOR(LuaExampleObject, add);
 			
-			//property consists of two methods: getter & setter
-			LOBJECT_ADD_PROPERTY(LuaExampleObject, ExampleObject *, "x", getX, setX);
+			//property bound directly to a data member, no getter & setter needed
+			LOBJECT_ADD_FIELD(LuaExampleObject, "x", x);
 
 			LOBJECT_ADD_METHOD(LuaExampleObject, "doSomething", doSomething);
 			LOBJECT_ADD_METHOD(LuaExampleObject, "doSomething2", doSomething2);
@@ -38,10 +38,9 @@ namespace Example {
 		int LOBJECT_OPERATOR(add, ExampleObject* objectA){
 			LuaExampleObject & wrapper = LOBJECT_INSTANCE(LuaExampleObject);
 
-			ExampleObject * objectT = new ExampleObject(*objectA);
-			ExampleObject * objectB = wrapper.check(2);
+			ExampleObject * objectB = wrapper.check(state, 2);
+			ExampleObject * objectT = wrapper.emplace(state, *objectA);
 			(*objectT) += (*objectB);
-			wrapper.push(objectT);
 			return 1;
 		}
 
@@ -52,16 +51,6 @@ namespace Example {
 
 		int LOBJECT_METHOD(doSomething2, ExampleObject * object);
 
-		int inline LOBJECT_METHOD(getX, ExampleObject * object){
-			state.push_integer(object->x);
-			return 1;
-		}
-		
-		int inline LOBJECT_METHOD(setX, ExampleObject * object){
-			object->x = static_cast<int>(state.to_number(1));
-			return 0;
-		}
-
 	};
 }
 
@@ -3,8 +3,8 @@
 local example1 = ExampleObject()
 local example2 = ExampleObject()
 			
-example1.doSomething()
-example2.doSomething2()
+example1:doSomething()
+example2:doSomething2()
 example1.x = 5
 print(example1.x)
 
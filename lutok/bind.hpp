@@ -0,0 +1,515 @@
+/// \file bind.hpp
+/// Compile-time binding of plain C++ functions into Lua.
+///
+/// The templates in this file generate, for every bound C++ function, a
+/// dedicated lua_CFunction that pulls the arguments off the Lua stack,
+/// converts them to the parameter types of the function, calls it directly and
+/// pushes its result back.  Unlike push_cxx_function(), the generated function
+/// needs neither an upvalue nor an indirect call.
+///
+/// Use it as follows:
+///
+/// double scale(double value, int factor);
+/// ...
+/// state.push_c_function(LUTOK_BIND(scale));
+///
+/// Supported parameter and result types are bool, all the arithmetic types,
+/// const char*, std::string and string_ref (also by const reference) and
+/// pointers, which are read from and pushed as light userdata.  Functions may
+/// also return void.  Arguments of the wrong type, fractional or out of range
+/// numbers passed as integers and any exception thrown by the function are
+/// reported as Lua errors.
+///
+/// push_cxx_functor() covers the stateful case: it pushes a lambda or functor
+/// whose captured state lives inside the closure userdata itself.
+
+#if !defined(LUTOK_BIND_HPP)
+#define LUTOK_BIND_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <lua.hpp>
+
+#include <lutok/c_gate.hpp>
+#include <lutok/exceptions.hpp>
+#include <lutok/state.hpp>
+
+/// Generates the lua_CFunction for the free function FUNCTION.
+#define LUTOK_BIND(FUNCTION) (lutok::bind< decltype(&FUNCTION), &FUNCTION >())
+
+namespace lutok {
+namespace detail {
+
+
+/// Raises the error for an argument of an unexpected type.
+///
+/// The error is raised as a C++ exception so that the arguments converted so
+/// far are properly destroyed; the generated lua_CFunction turns it into a Lua
+/// error once no C++ objects are alive.
+///
+/// \param raw_state The Lua C API state.
+/// \param index The stack index of the offending argument.
+/// \param expected The name of the expected Lua type.
+///
+/// \throw error Always.
+inline void
+argument_error(lua_State* raw_state, const int index, const char* expected)
+{
+    char message[128];
+    std::snprintf(message, sizeof(message),
+                  "bad argument #%d (%s expected, got %s)", index, expected,
+                  luaL_typename(raw_state, index));
+    throw lutok::error(message);
+}
+
+
+/// Raises the error for an argument of the right type but an invalid value.
+///
+/// \param index The stack index of the offending argument.
+/// \param problem What is wrong with the value.
+///
+/// \throw error Always.
+inline void
+value_error(const int index, const char* problem)
+{
+    char message[128];
+    std::snprintf(message, sizeof(message), "bad argument #%d (%s)", index,
+                  problem);
+    throw lutok::error(message);
+}
+
+
+/// Checks whether a number can be converted to an arithmetic type.
+///
+/// Converting NaN or a number out of the range of an integral type is
+/// undefined behaviour, so such values must be rejected before any cast.
+/// Floating point types accept every number.
+///
+/// \param value The number to convert.
+///
+/// \return True if static_cast< Type >(value) is well defined.
+template< typename Type >
+inline bool
+number_fits(const lua_Number value)
+{
+    if (!std::is_integral< Type >::value)
+        return true;
+    // The bounds of integral types are zero or powers of two, hence exact.
+    // Comparisons with NaN are false, which rejects it as well.
+    return value >= static_cast< lua_Number >(
+               std::numeric_limits< Type >::min()) &&
+           value < std::ldexp(static_cast< lua_Number >(1),
+                              std::numeric_limits< Type >::digits);
+}
+
+
+/// Conversion of C++ values from and to the Lua stack.
+///
+/// get() checks and converts the value in a single step; push() leaves exactly
+/// one value on the stack.
+template< typename Type, typename Enable = void >
+struct stack_value;
+
+
+/// Conversion of booleans.
+template<>
+struct stack_value< bool > {
+    static bool
+    get(lua_State* raw_state, const int index)
+    {
+        if (!lua_isboolean(raw_state, index))
+            argument_error(raw_state, index, "boolean");
+        return lua_toboolean(raw_state, index) != 0;
+    }
+
+    static void
+    push(lua_State* raw_state, const bool value)
+    {
+        lua_pushboolean(raw_state, value ? 1 : 0);
+    }
+};
+
+
+/// Conversion of integral types.
+template< typename Type >
+struct stack_value< Type, typename std::enable_if<
+    std::is_integral< Type >::value && !std::is_same< Type, bool >::value
+    >::type > {
+    static Type
+    get(lua_State* raw_state, const int index)
+    {
+        if (!lua_isnumber(raw_state, index))
+            argument_error(raw_state, index, "number");
+        const lua_Number value = lua_tonumber(raw_state, index);
+        if (value != std::floor(value))
+            argument_error(raw_state, index, "integer");
+        if (!number_fits< Type >(value))
+            value_error(index, "number out of range");
+        return static_cast< Type >(value);
+    }
+
+    static void
+    push(lua_State* raw_state, const Type value)
+    {
+        lua_pushinteger(raw_state, static_cast< lua_Integer >(value));
+    }
+};
+
+
+/// Conversion of floating point types.
+template< typename Type >
+struct stack_value< Type, typename std::enable_if<
+    std::is_floating_point< Type >::value >::type > {
+    static Type
+    get(lua_State* raw_state, const int index)
+    {
+        const lua_Number value = lua_tonumber(raw_state, index);
+        if (value == 0 && !lua_isnumber(raw_state, index))
+            argument_error(raw_state, index, "number");
+        return static_cast< Type >(value);
+    }
+
+    static void
+    push(lua_State* raw_state, const Type value)
+    {
+        lua_pushnumber(raw_state, static_cast< lua_Number >(value));
+    }
+};
+
+
+/// Conversion of C strings.
+///
+/// The returned pointer is owned by Lua and remains valid while the argument
+/// stays on the stack, i.e. during the whole call.
+template<>
+struct stack_value< const char* > {
+    static const char*
+    get(lua_State* raw_state, const int index)
+    {
+        const char* value = lua_tostring(raw_state, index);
+        if (value == NULL)
+            argument_error(raw_state, index, "string");
+        return value;
+    }
+
+    static void
+    push(lua_State* raw_state, const char* value)
+    {
+        if (value == NULL)
+            lua_pushnil(raw_state);
+        else
+            lua_pushstring(raw_state, value);
+    }
+};
+
+
+/// Conversion of C++ strings.
+template<>
+struct stack_value< std::string > {
+    static std::string
+    get(lua_State* raw_state, const int index)
+    {
+        size_t length;
+        const char* value = lua_tolstring(raw_state, index, &length);
+        if (value == NULL)
+            argument_error(raw_state, index, "string");
+        return std::string(value, length);
+    }
+
+    static void
+    push(lua_State* raw_state, const std::string& value)
+    {
+        lua_pushlstring(raw_state, value.c_str(), value.size());
+    }
+};
+
+
+/// Conversion of string views.
+///
+/// Arguments are not copied: the view refers to the string on the stack,
+/// which stays valid during the whole call.
+template<>
+struct stack_value< string_ref > {
+    static string_ref
+    get(lua_State* raw_state, const int index)
+    {
+        size_t length;
+        const char* value = lua_tolstring(raw_state, index, &length);
+        if (value == NULL)
+            argument_error(raw_state, index, "string");
+        return string_ref(value, length);
+    }
+
+    static void
+    push(lua_State* raw_state, const string_ref& value)
+    {
+        lua_pushlstring(raw_state, value.data(), value.size());
+    }
+};
+
+
+/// Conversion of pointers to and from light userdata.
+///
+/// nil is accepted as a NULL pointer and NULL pointers are pushed as nil.
+/// Full userdata are rejected: their memory block carries no type, so handing
+/// out its address would let a script pass any object as any pointer type.
+template< typename Type >
+struct stack_value< Type*, typename std::enable_if<
+    !std::is_same< typename std::remove_cv< Type >::type, char >::value
+    >::type > {
+    static Type*
+    get(lua_State* raw_state, const int index)
+    {
+        if (lua_islightuserdata(raw_state, index))
+            return static_cast< Type* >(lua_touserdata(raw_state, index));
+        if (!lua_isnil(raw_state, index))
+            argument_error(raw_state, index, "light userdata");
+        return NULL;
+    }
+
+    static void
+    push(lua_State* raw_state, Type* value)
+    {
+        if (value == NULL)
+            lua_pushnil(raw_state);
+        else
+            lua_pushlightuserdata(raw_state,
+                const_cast< void* >(static_cast< const void* >(value)));
+    }
+};
+
+
+/// Strips references and top-level qualifiers from a parameter type.
+template< typename Type >
+struct argument_type {
+    typedef typename std::remove_cv<
+        typename std::remove_reference< Type >::type >::type type;
+};
+
+
+/// Compile-time list of argument indexes.
+template< int... Indexes >
+struct index_list {
+};
+
+
+/// Builds index_list< 0, 1, ..., Count - 1 >.
+template< int Count, int... Indexes >
+struct make_index_list : make_index_list< Count - 1, Count - 1, Indexes... > {
+};
+
+
+template< int... Indexes >
+struct make_index_list< 0, Indexes... > {
+    typedef index_list< Indexes... > type;
+};
+
+
+/// Calls a function and pushes its result, if any.
+template< typename Result >
+struct result_pusher {
+    template< typename Function, typename... Values >
+    static int
+    call(lua_State* raw_state, Function function, Values&&... values)
+    {
+        stack_value< typename argument_type< Result >::type >::push(
+            raw_state, function(std::forward< Values >(values)...));
+        return 1;
+    }
+};
+
+
+template<>
+struct result_pusher< void > {
+    template< typename Function, typename... Values >
+    static int
+    call(lua_State* /* raw_state */, Function function, Values&&... values)
+    {
+        function(std::forward< Values >(values)...);
+        return 0;
+    }
+};
+
+
+/// Generator of the lua_CFunction for a specific C++ function.
+template< typename Signature, Signature Function >
+struct binder;
+
+
+template< typename Result, typename... Args, Result (*Function)(Args...) >
+struct binder< Result (*)(Args...), Function > {
+    template< int... Indexes >
+    static int
+    call(lua_State* raw_state, index_list< Indexes... >)
+    {
+        return result_pusher< Result >::call(raw_state, Function,
+            stack_value< typename argument_type< Args >::type >::get(
+                raw_state, Indexes + 1)...);
+    }
+
+    /// The lua_CFunction bound into Lua.
+    ///
+    /// \param raw_state The Lua C API state.
+    ///
+    /// \return The number of return values pushed onto the stack.
+    static int
+    invoke(lua_State* raw_state)
+    {
+        char error_buf[1024];
+
+        try {
+            return call(raw_state,
+                        typename make_index_list< sizeof...(Args) >::type());
+        } catch (const std::exception& e) {
+            std::strncpy(error_buf, e.what(), sizeof(error_buf));
+        } catch (...) {
+            std::strncpy(error_buf, "Unhandled exception in Lua C++ hook",
+                         sizeof(error_buf));
+        }
+        error_buf[sizeof(error_buf) - 1] = '\0';
+        // As in the trampolines of state.cpp, raise the Lua error from outside
+        // of the try/catch context so that no C++ objects are skipped by the
+        // longjmp.
+        return luaL_error(raw_state, "%s", error_buf);
+    }
+};
+
+
+/// Generator of the Lua glue for a specific functor type.
+///
+/// The functor object lives in a userdata which is the only upvalue of the
+/// closure; it is called directly through its concrete type.
+template< typename Functor >
+struct functor_binder {
+    /// Registry key of the metatable that destroys functors of this type.
+    static char metatable_key;
+
+    /// The lua_CFunction bound into Lua.
+    ///
+    /// \param raw_state The Lua C API state.
+    ///
+    /// \return The number of return values pushed onto the stack.
+    static int
+    invoke(lua_State* raw_state)
+    {
+        char error_buf[1024];
+
+        try {
+            Functor* functor = static_cast< Functor* >(
+                lua_touserdata(raw_state, lua_upvalueindex(1)));
+            lutok::state state = lutok::state_c_gate::connect(raw_state);
+            return (*functor)(state);
+        } catch (const std::exception& e) {
+            std::strncpy(error_buf, e.what(), sizeof(error_buf));
+        } catch (...) {
+            std::strncpy(error_buf, "Unhandled exception in Lua C++ hook",
+                         sizeof(error_buf));
+        }
+        error_buf[sizeof(error_buf) - 1] = '\0';
+        return luaL_error(raw_state, "%s", error_buf);
+    }
+
+    /// The __gc metamethod of the functor userdata.
+    ///
+    /// \param raw_state The Lua C API state.
+    ///
+    /// \return Always 0.
+    static int
+    collect(lua_State* raw_state)
+    {
+        Functor* functor = static_cast< Functor* >(lua_touserdata(raw_state, 1));
+        functor->~Functor();
+        return 0;
+    }
+
+    /// Pushes the metatable shared by all the functors of this type.
+    ///
+    /// \param raw_state The Lua C API state.
+    static void
+    push_metatable(lua_State* raw_state)
+    {
+        lua_pushlightuserdata(raw_state, &metatable_key);
+        lua_rawget(raw_state, LUA_REGISTRYINDEX);
+        if (lua_isnil(raw_state, -1)) {
+            lua_pop(raw_state, 1);
+            lua_createtable(raw_state, 0, 1);
+            lua_pushcfunction(raw_state, collect);
+            lua_setfield(raw_state, -2, "__gc");
+            lua_pushlightuserdata(raw_state, &metatable_key);
+            lua_pushvalue(raw_state, -2);
+            lua_rawset(raw_state, LUA_REGISTRYINDEX);
+        }
+    }
+};
+
+
+template< typename Functor >
+char functor_binder< Functor >::metatable_key;
+
+
+}  // namespace detail
+
+
+/// Returns the lua_CFunction that calls the given C++ function.
+///
+/// \tparam Signature The type of the function pointer.
+/// \tparam Function The function to bind.
+///
+/// \return A plain C function that can be pushed with state::push_c_function()
+/// or registered with create_module() and registerLib().
+template< typename Signature, Signature Function >
+c_function
+bind(void)
+{
+    return &detail::binder< Signature, Function >::invoke;
+}
+
+
+/// Pushes a C++ callable object as a Lua function.
+///
+/// The callable, which must be invocable as int(state&) just like a
+/// cxx_function, is moved into the userdata that backs the closure, so any
+/// state it captures is stored inline with no extra allocation.  Calls go
+/// through a trampoline generated for the concrete type, without std::function
+/// or any other type erasure.  The callable is destroyed when Lua collects the
+/// closure.
+///
+/// \param s The Lua state.
+/// \param functor The callable to push.
+///
+/// \warning Terminates execution if there is not enough memory.
+template< typename Functor >
+void
+push_cxx_functor(state& s, Functor functor)
+{
+    static_assert(std::alignment_of< Functor >::value <=
+                  std::alignment_of< double >::value,
+                  "Lua userdata cannot hold over-aligned functors");
+    lua_State* raw_state = state_c_gate(s).c_state();
+
+    void* storage = lua_newuserdata(raw_state, sizeof(Functor));
+    try {
+        new (storage) Functor(std::move(functor));
+    } catch (...) {
+        lua_pop(raw_state, 1);
+        throw;
+    }
+    if (!std::is_trivially_destructible< Functor >::value) {
+        detail::functor_binder< Functor >::push_metatable(raw_state);
+        lua_setmetatable(raw_state, -2);
+    }
+    lua_pushcclosure(raw_state, &detail::functor_binder< Functor >::invoke, 1);
+}
+
+
+}  // namespace lutok
+
+#endif  // !defined(LUTOK_BIND_HPP)
@@ -0,0 +1 @@
+#include "../../key.hpp"
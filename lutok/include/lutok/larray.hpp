@@ -0,0 +1 @@
+#include "../../larray.hpp"
@@ -0,0 +1 @@
+#include "../../lcomponent.hpp"
@@ -0,0 +1 @@
+#include "../../lfield.hpp"
@@ -0,0 +1 @@
+#include "../../lhandle.hpp"
@@ -0,0 +1 @@
+#include "../../marshal.hpp"
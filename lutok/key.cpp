@@ -0,0 +1,44 @@
+#include <lua.hpp>
+
+#include "c_gate.hpp"
+#include "key.hpp"
+#include "state.ipp"
+
+
+/// Interns a key in the given state.
+///
+/// The key keeps the main thread to release the reference, as the registry is
+/// shared by all threads and the thread the key was created on may be
+/// collected first.
+///
+/// \param state_ The Lua state.
+/// \param name_ The name of the key.
+///
+/// \warning Terminates execution if there is not enough memory.
+lutok::key::key(state& state_, const std::string& name_) :
+    _lua_state(static_cast< lua_State* >(state_.getMainLuaState())),
+    _name(name_)
+{
+    lua_State* raw_state = state_c_gate(state_).c_state();
+    lua_pushlstring(raw_state, _name.c_str(), _name.size());
+    _reference = luaL_ref(raw_state, LUA_REGISTRYINDEX);
+}
+
+
+/// Takes over the reference of another key, which is left empty.
+///
+/// \param other The key to move from.
+lutok::key::key(key&& other) :
+    _lua_state(other._lua_state),
+    _reference(other._reference),
+    _name(other._name)
+{
+    other._reference = LUA_NOREF;
+}
+
+
+/// Releases the reference to the interned string.
+lutok::key::~key(void)
+{
+    luaL_unref(_lua_state, LUA_REGISTRYINDEX, _reference);
+}
@@ -0,0 +1,71 @@
+/// \file key.hpp
+/// Provides the key class, a table key interned once per Lua state.
+
+#if !defined(LUTOK_KEY_HPP)
+#define LUTOK_KEY_HPP
+
+#include <string>
+
+struct lua_State;
+
+namespace lutok {
+
+
+class state;
+
+
+/// A string key interned in a Lua state ahead of time.
+///
+/// Accessing a field by name makes Lua measure, hash and look up the name in
+/// its string table on every call.  A key does that once, at construction,
+/// and anchors the resulting Lua string in the registry; state::get_field(),
+/// state::set_field() and their raw counterparts then fetch it back by its
+/// integer reference, so hot accesses do no hashing on the C++ side.
+///
+/// Keys belong to the state they were created for and must not outlive it.
+///
+/// Use this class as follows:
+///
+/// const lutok::key position_key(state, "position");
+/// ...
+/// state.get_field(-1, position_key);
+class key {
+    /// The main thread of the Lua state holding the reference.
+    lua_State* _lua_state;
+
+    /// The registry reference anchoring the interned string.
+    int _reference;
+
+    /// The name of the key.
+    std::string _name;
+
+    /// Disallow copies.
+    key(const key&);
+
+    /// Disallow assignment.
+    key& operator=(const key&);
+
+public:
+    key(state&, const std::string&);
+    key(key&&);
+    ~key(void);
+
+    /// Returns the name of the key.
+    const std::string&
+    name(void) const
+    {
+        return _name;
+    }
+
+    /// Returns the registry reference of the interned string.
+    int
+    reference(void) const
+    {
+        return _reference;
+    }
+};
+
+
+}  // namespace lutok
+
+#endif  // !defined(LUTOK_KEY_HPP)
@@ -0,0 +1,329 @@
+#if !defined(LUTOK_LARRAY_HPP)
+#define LUTOK_LARRAY_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+
+#include <lua.hpp>
+#include <lutok/bind.hpp>
+#include <lutok/lobject.hpp>
+#include <type_traits>
+
+namespace lutok {
+
+/*
+  LArrayBuffer is a contiguous run of numbers seen by Lua as a typed array. It either owns its
+  memory, shared with the slices taken from it, or refers to an external buffer owned by C++, in
+  which case the buffer must outlive every Lua value referring to it.
+*/
+template< typename E >
+class LArrayBuffer {
+public:
+	typedef E ElementType;
+
+	// Owned array of length zero initialized elements
+	explicit LArrayBuffer(size_t length)
+		: storage(new E[length](), std::default_delete< E[] >()), data(storage.get()), length(length){
+	}
+
+	// External buffer, not copied
+	LArrayBuffer(E * data, size_t length)
+		: data(data), length(length){
+	}
+
+	// View of length elements of parent starting at offset, sharing its memory
+	LArrayBuffer(const LArrayBuffer & parent, size_t offset, size_t length)
+		: storage(parent.storage), data(parent.data + offset), length(length){
+		assert(offset + length <= parent.length);
+	}
+
+	bool isExternal() const{
+		return !storage;
+	}
+
+	std::shared_ptr< E > storage;
+	E * data;
+	size_t length;
+};
+
+template< typename E >
+struct LArrayTraits;
+
+template<> struct LArrayTraits< float > { static const char * name(){ return "FloatArray"; } };
+template<> struct LArrayTraits< double > { static const char * name(){ return "DoubleArray"; } };
+template<> struct LArrayTraits< int32_t > { static const char * name(){ return "Int32Array"; } };
+template<> struct LArrayTraits< int64_t > { static const char * name(){ return "Int64Array"; } };
+template<> struct LArrayTraits< uint8_t > { static const char * name(){ return "UInt8Array"; } };
+
+/*
+  LArray exposes LArrayBuffer<E> to Lua as an LObject class, so arrays are pushed, checked and
+  collected like any other wrapped object. Handing a buffer to a script takes a single userdata
+  allocation whatever its size: wrap() pushes a view of an external buffer and create() a new
+  owned array, both stored inside the userdata.
+
+  From Lua, with Name one of FloatArray, DoubleArray, Int32Array, Int64Array and UInt8Array once
+  Register() has been called:
+
+    Name(n) or Name{...}    new owned array, zeroed or copied from a table
+    a[i], a[i] = v, #a      1-based element access; reads past the end yield nil, writes raise
+                            an error; integral elements truncate stored values towards zero and
+                            reject NaN and values out of their range with an error
+    a:slice([i [, j]])      view of the elements i to j, sharing the memory of a
+    a:totable([i [, j]])    new table holding the elements i to j
+    a:assign(t [, i])       copies the elements of the table t into a, starting at element i
+
+  Int64Array elements go through lua_Number, so magnitudes above 2^53 lose precision.
+*/
+template< typename E >
+class LArray : public LObject< LArray< E >, LArrayBuffer< E > * > {
+	typedef LObject< LArray< E >, LArrayBuffer< E > * > Wrapper;
+public:
+	typedef LArrayBuffer< E > Buffer;
+
+	LArray(lutok::state & state)
+		: Wrapper(state, LArrayTraits< E >::name()){
+		LOBJECT_ADD_OPERATOR(LArray, len);
+		LOBJECT_ADD_METHOD(LArray, "slice", slice);
+		LOBJECT_ADD_METHOD(LArray, "totable", totable);
+		LOBJECT_ADD_METHOD(LArray, "assign", assign);
+		installMetatable();
+	}
+
+	void destructor(lutok::state & s, Buffer * buffer){
+		delete buffer;
+	}
+
+/*
+  @ create
+  Arguments:
+	s	- Lua State to push onto, the main thread when omitted
+	length	- Number of elements
+
+  Description:
+    Pushes a new owned array of zeroed elements.
+*/
+	Buffer * create(lutok::state & s, size_t length){
+		return this->emplace(s, length);
+	}
+
+	Buffer * create(size_t length){
+		return create(this->state, length);
+	}
+
+/*
+  @ wrap
+  Arguments:
+	s	- Lua State to push onto, the main thread when omitted
+	data	- External buffer
+	length	- Number of elements
+
+  Description:
+    Pushes an array referring to an external buffer without copying it. The buffer must stay
+	alive as long as Lua may reach the array or any slice of it.
+*/
+	Buffer * wrap(lutok::state & s, E * data, size_t length){
+		return this->emplace(s, data, length);
+	}
+
+	Buffer * wrap(E * data, size_t length){
+		return wrap(this->state, data, length);
+	}
+
+/*
+  @ Register
+  Arguments:
+	namespac	- Table receiving the constructor, the globals if empty
+
+  Description:
+    Exposes the constructor of the array type to Lua under the class name.
+*/
+	void Register(const std::string & namespac = ""){
+		lua_State * L = raw(this->state);
+		if (namespac.empty()){
+			lua_pushvalue(L, LUA_GLOBALSINDEX);
+		}else{
+			lua_getglobal(L, namespac.c_str());
+			if (lua_isnil(L, -1)){
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				lua_setglobal(L, namespac.c_str());
+			}
+		}
+		this->state.push_lightuserdata(this);
+		this->state.push_cxx_closure(create_array, 1);
+		lua_setfield(L, -2, this->className.c_str());
+		lua_pop(L, 1);
+	}
+
+	int LOBJECT_OPERATOR(len, Buffer * buffer){
+		lua_pushinteger(raw(state), static_cast< lua_Integer >(buffer->length));
+		return 1;
+	}
+
+	int LOBJECT_METHOD(slice, Buffer * buffer){
+		size_t first, count;
+		checkRange(raw(state), buffer, 2, first, count);
+		this->emplace(state, *buffer, first, count);
+		return 1;
+	}
+
+	int LOBJECT_METHOD(totable, Buffer * buffer){
+		lua_State * L = raw(state);
+		size_t first, count;
+		checkRange(L, buffer, 2, first, count);
+		lua_createtable(L, static_cast< int >(count), 0);
+		for (size_t i = 0; i < count; i++){
+			lutok::detail::stack_value< E >::push(L, buffer->data[first + i]);
+			lua_rawseti(L, -2, static_cast< int >(i + 1));
+		}
+		return 1;
+	}
+
+	int LOBJECT_METHOD(assign, Buffer * buffer){
+		lua_State * L = raw(state);
+		luaL_checktype(L, 2, LUA_TTABLE);
+		const lua_Integer first = luaL_optinteger(L, 3, 1);
+		const size_t count = lua_objlen(L, 2);
+		if (first < 1 || static_cast< size_t >(first - 1) + count > buffer->length){
+			luaL_argerror(L, 3, "table does not fit in the array");
+		}
+		copyFromTable(L, 2, buffer->data + (first - 1), count);
+		return 0;
+	}
+
+private:
+	static lua_State * raw(lutok::state & s){
+		return static_cast< lua_State * >(s.getLuaState());
+	}
+
+	// Replaces the __index and __newindex set by LObject with versions handling element indices
+	// first. The metatable exists from the start, so pushing an array never registers it.
+	// Element access is the hot path, so these are plain C functions rather than cxx_functions
+	// behind the trampoline; nothing on their path throws, as arrays have no properties. Both get
+	// the metatable as an upvalue to check self on the calling thread without a registry lookup.
+	void installMetatable(){
+		Wrapper::Register();
+		lua_State * L = raw(this->state);
+		lua_pushlightuserdata(L, this);
+		lua_pushvalue(L, -2);
+		lua_pushcclosure(L, element_getter, 2);
+		lua_setfield(L, -2, "__index");
+		lua_pushlightuserdata(L, this);
+		lua_pushvalue(L, -2);
+		lua_pushcclosure(L, element_setter, 2);
+		lua_setfield(L, -2, "__newindex");
+		lua_pop(L, 1);
+	}
+
+	static LArray * self(lutok::state & s){
+		return static_cast< LArray * >(const_cast< void * >(s.to_lightuserdata(s.upvalue_index(1))));
+	}
+
+	// Reads the optional 1-based inclusive range i, j at narg, narg + 1, defaulting to the whole array
+	static void checkRange(lua_State * L, const Buffer * buffer, int narg, size_t & first, size_t & count){
+		const lua_Integer length = static_cast< lua_Integer >(buffer->length);
+		const lua_Integer i = luaL_optinteger(L, narg, 1);
+		const lua_Integer j = luaL_optinteger(L, narg + 1, length);
+		if (i < 1 || j > length || j < i - 1){
+			luaL_error(L, "range [%d, %d] out of the bounds of an array of %d elements",
+				static_cast< int >(i), static_cast< int >(j), static_cast< int >(length));
+		}
+		first = static_cast< size_t >(i - 1);
+		count = static_cast< size_t >(j - i + 1);
+	}
+
+	static void copyFromTable(lua_State * L, int table, E * data, size_t count){
+		for (size_t i = 0; i < count; i++){
+			lua_rawgeti(L, table, static_cast< int >(i + 1));
+			if (!lua_isnumber(L, -1)){
+				luaL_error(L, "number expected at index %d of the table, got %s",
+					static_cast< int >(i + 1), luaL_typename(L, -1));
+			}
+			const lua_Number value = lua_tonumber(L, -1);
+			if (!lutok::detail::number_fits< E >(value)){
+				luaL_error(L, "number at index %d of the table out of the range of the elements",
+					static_cast< int >(i + 1));
+			}
+			data[i] = static_cast< E >(value);
+			lua_pop(L, 1);
+		}
+	}
+
+	static int create_array(lutok::state & s){
+		lua_State * L = raw(s);
+		LArray * thisobj = self(s);
+		if (lua_istable(L, 1)){
+			const size_t count = lua_objlen(L, 1);
+			Buffer * buffer = thisobj->create(s, count);
+			copyFromTable(L, 1, buffer->data, count);
+			return 1;
+		}
+		const lua_Integer length = luaL_checkinteger(L, 1);
+		if (length < 0){
+			luaL_argerror(L, 1, "negative length");
+		}
+		thisobj->create(s, static_cast< size_t >(length));
+		return 1;
+	}
+
+	// Buffer of the array at index 1 of the element accessor being run, raising a type error on L
+	// if it is not an array of this class
+	static Buffer * checkElementSelf(lua_State * L){
+		if (lua_getmetatable(L, 1)){
+			const bool self = lua_rawequal(L, -1, lua_upvalueindex(2)) != 0;
+			lua_pop(L, 1);
+			if (self){
+				return std::get<1>(**static_cast< typename Wrapper::LObjectTuple ** >(lua_touserdata(L, 1)));
+			}
+		}
+		luaL_typerror(L, 1, static_cast< LArray * >(lua_touserdata(L, lua_upvalueindex(1)))->className.c_str());
+		return NULL;
+	}
+
+	static int element_getter(lua_State * L){
+		if (lua_type(L, 2) != LUA_TNUMBER){
+			lutok::state s(L);
+			return Wrapper::property_getter(s);
+		}
+		const Buffer * buffer = checkElementSelf(L);
+		const lua_Integer index = lua_tointeger(L, 2);
+		if (index < 1 || static_cast< size_t >(index) > buffer->length){
+			lua_pushnil(L);
+		}else{
+			lutok::detail::stack_value< E >::push(L, buffer->data[index - 1]);
+		}
+		return 1;
+	}
+
+	static int element_setter(lua_State * L){
+		if (lua_type(L, 2) != LUA_TNUMBER){
+			lutok::state s(L);
+			return Wrapper::property_setter(s);
+		}
+		Buffer * buffer = checkElementSelf(L);
+		const lua_Integer index = lua_tointeger(L, 2);
+		if (index < 1 || static_cast< size_t >(index) > buffer->length){
+			luaL_error(L, "index %d out of the bounds of an array of %d elements",
+				static_cast< int >(index), static_cast< int >(buffer->length));
+		}
+		const lua_Number value = luaL_checknumber(L, 3);
+		if (!lutok::detail::number_fits< E >(value)){
+			luaL_argerror(L, 3, "number out of the range of the elements");
+		}
+		buffer->data[index - 1] = static_cast< E >(value);
+		return 0;
+	}
+};
+
+typedef LArray< float > LFloatArray;
+typedef LArray< double > LDoubleArray;
+typedef LArray< int32_t > LInt32Array;
+typedef LArray< int64_t > LInt64Array;
+typedef LArray< uint8_t > LUInt8Array;
+
+}
+#endif
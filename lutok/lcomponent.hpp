@@ -0,0 +1,546 @@
+#if !defined(LUTOK_LCOMPONENT_HPP)
+#define LUTOK_LCOMPONENT_HPP
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <lua.hpp>
+#include <lutok/bind.hpp>
+#include <lutok/exceptions.hpp>
+#include <lutok/lobject.hpp>
+#include <type_traits>
+
+#define LCOMPONENT_DEFINE_STORE(CLASSNAME, VALUETYPE, LUANAME) CLASSNAME(lutok::state & state) : LComponentStore<CLASSNAME, VALUETYPE>::LComponentStore( state, (LUANAME))
+#define LCOMPONENT_ADD_FIELD(CLASSNAME, LUANAME, FIELD) this->addField((LUANAME), &CLASSNAME::ValueType::FIELD)
+
+namespace lutok {
+
+/*
+  LComponentStore keeps records of type V as a structure of arrays: every registered field of V
+  lives in its own contiguous array, indexed by row. Ids handed out to Lua stay stable while rows
+  are kept dense by moving the last row into the hole left by a removed one.
+
+  Register() exposes the store as a table of functions, so per-frame updates run as batch
+  operations over whole columns instead of one Lua->C++ call per object and field:
+
+    store.create() -> id                store.remove(id)          store.count()
+    store.ids() -> {id...}              store.get(id, field)      store.set(id, field, value)
+    store.apply(field, op, operand [, ids])   op is "set", "add", "sub", "mul", "div", "min" or
+                                              "max"; operand is a number or the name of a field
+                                              of the same type
+    store.axpy(field, source, k [, ids])      field += k * source, clamped to the range of
+                                              integral fields
+    store.map(field, function [, ids])        field = function(field)
+    store.gather(field [, ids]) -> {value...}
+    store.scatter(field, {value...} [, ids])
+
+  ids is an optional array of ids restricting the operation; without it the operation runs over
+  all rows in a plain loop the compiler can vectorize. Fields must be arithmetic, bool excluded.
+  The function passed to map() may use the store, but removing an id still to be visited raises
+  an error; ids created meanwhile are not visited.
+*/
+template <class C, typename V>
+class LComponentStore: public LSingleton<C> {
+protected:
+	lutok::state state;
+public:
+	typedef V ValueType;
+
+	enum Operation { OpSet, OpAdd, OpSub, OpMul, OpDiv, OpMin, OpMax };
+
+	std::string storeName;
+
+private:
+	class Column {
+	public:
+		virtual ~Column() {};
+		virtual void append(const ValueType & value) = 0;
+		virtual void store(size_t row, const ValueType & value) = 0;
+		virtual void load(size_t row, ValueType & value) const = 0;
+		virtual void move(size_t from, size_t to) = 0;
+		virtual void pop_back() = 0;
+		virtual void push(lua_State * L, size_t row) const = 0;
+		virtual void set(lua_State * L, int index, size_t row) = 0;
+		virtual bool fits(lua_Number value) const = 0;
+		virtual bool apply(Operation op, lua_Number operand, const size_t * rows, size_t n) = 0;
+		virtual bool apply(Operation op, const Column & source, lua_Number k, const size_t * rows, size_t n) = 0;
+	};
+
+	template< typename F >
+	class TypedColumn: public Column {
+	public:
+		static_assert(std::is_arithmetic< F >::value && !std::is_same< F, bool >::value,
+			"Only arithmetic data members can be stored as components");
+
+		F ValueType::* member;
+		std::vector< F > data;
+
+		explicit TypedColumn(F ValueType::* member) : member(member) {}
+
+		void append(const ValueType & value){
+			data.push_back(value.*member);
+		}
+		void store(size_t row, const ValueType & value){
+			data[row] = value.*member;
+		}
+		void load(size_t row, ValueType & value) const{
+			value.*member = data[row];
+		}
+		void move(size_t from, size_t to){
+			data[to] = data[from];
+		}
+		void pop_back(){
+			data.pop_back();
+		}
+		void push(lua_State * L, size_t row) const{
+			lua_pushnumber(L, static_cast< lua_Number >(data[row]));
+		}
+		void set(lua_State * L, int index, size_t row){
+			const lua_Number value = luaL_checknumber(L, index);
+			if (!fits(value)){
+				luaL_argerror(L, index, "number out of the range of the field");
+			}
+			data[row] = static_cast< F >(value);
+		}
+		bool fits(lua_Number value) const{
+			return lutok::detail::number_fits< F >(value);
+		}
+
+		// operand must fit in F, see fits(). Integral fields add, subtract, multiply and divide in
+		// lua_Number and saturate, as the result may not fit in F
+		bool apply(Operation op, lua_Number operand, const size_t * rows, size_t n){
+			const F value = static_cast< F >(operand);
+			if (op == OpDiv && value == F(0) && std::is_integral< F >::value){
+				return false;
+			}
+			const Scalar x = static_cast< Scalar >(value);
+			F * d = data.data();
+			if (rows){
+				for (size_t i = 0; i < n; i++){
+					d[rows[i]] = narrow(combine< Scalar >(op, d[rows[i]], x));
+				}
+				return true;
+			}
+			switch (op){	// one loop per operation, so each can be vectorized
+			case OpSet: for (size_t i = 0; i < n; i++) d[i] = value; break;
+			case OpAdd: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] + x); break;
+			case OpSub: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] - x); break;
+			case OpMul: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] * x); break;
+			case OpDiv: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] / x); break;
+			case OpMin: for (size_t i = 0; i < n; i++) d[i] = d[i] < value ? d[i] : value; break;
+			case OpMax: for (size_t i = 0; i < n; i++) d[i] = d[i] > value ? d[i] : value; break;
+			}
+			return true;
+		}
+
+		bool apply(Operation op, const Column & source, lua_Number k, const size_t * rows, size_t n){
+			const TypedColumn * other = dynamic_cast< const TypedColumn * >(&source);
+			if (!other){
+				return false;
+			}
+			if (op == OpDiv && std::is_integral< F >::value){
+				return false;
+			}
+			const Scalar factor = static_cast< Scalar >(k);
+			F * d = data.data();
+			const F * s = other->data.data();
+			if (rows){
+				for (size_t i = 0; i < n; i++){
+					d[rows[i]] = narrow(combine< Scalar >(op, d[rows[i]], factor * s[rows[i]]));
+				}
+				return true;
+			}
+			switch (op){
+			case OpSet: for (size_t i = 0; i < n; i++) d[i] = narrow(factor * s[i]); break;
+			case OpAdd: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] + factor * s[i]); break;
+			case OpSub: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] - factor * s[i]); break;
+			case OpMul: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] * (factor * s[i])); break;
+			case OpDiv: for (size_t i = 0; i < n; i++) d[i] = narrow(d[i] / (factor * s[i])); break;
+			case OpMin: for (size_t i = 0; i < n; i++) d[i] = narrow(combine< Scalar >(OpMin, d[i], factor * s[i])); break;
+			case OpMax: for (size_t i = 0; i < n; i++) d[i] = narrow(combine< Scalar >(OpMax, d[i], factor * s[i])); break;
+			}
+			return true;
+		}
+
+	private:
+		// Integral fields combine in lua_Number, so a fractional factor is not truncated and an
+		// overflowing result saturates, and convert the result once
+		typedef typename std::conditional< std::is_integral< F >::value, lua_Number, F >::type Scalar;
+
+		// Converts a result to F, clamped to the range of integral fields, where NaN yields 0
+		static F narrow(Scalar value){
+			if (!lutok::detail::number_fits< F >(value)){
+				return value > 0 ? std::numeric_limits< F >::max() : value < 0 ? std::numeric_limits< F >::min() : F(0);
+			}
+			return static_cast< F >(value);
+		}
+
+		template< typename T >
+		static T combine(Operation op, T a, T b){
+			switch (op){
+			case OpSet: return b;
+			case OpAdd: return a + b;
+			case OpSub: return a - b;
+			case OpMul: return a * b;
+			case OpDiv: return a / b;
+			case OpMin: return a < b ? a : b;
+			case OpMax: return a > b ? a : b;
+			}
+			return a;
+		}
+	};
+
+	std::vector< Column * > columns;
+	std::map< std::string, Column * > columnNames;
+
+	std::vector< size_t > rowOfId;	// npos for unused ids
+	std::vector< size_t > idOfRow;
+	std::vector< size_t > freeIds;
+	std::vector< size_t > selection;	// scratch buffer, a member so Lua errors don't skip a destructor
+
+	static const size_t npos = static_cast< size_t >(-1);
+
+	LComponentStore(const LComponentStore &);
+	LComponentStore & operator=(const LComponentStore &);
+
+protected:
+	LComponentStore(lutok::state & state, const std::string & storeName)
+		: state(state.getMainLuaState()), storeName(storeName){
+	}
+
+	template< typename F >
+	void addField(const std::string & name, F ValueType::* member){
+		assert(idOfRow.empty());
+		TypedColumn< F > * column = new TypedColumn< F >(member);
+		columns.push_back(column);
+		columnNames[name] = column;
+	}
+
+public:
+	~LComponentStore(){
+		for (size_t i = 0; i < columns.size(); i++){
+			delete columns[i];
+		}
+	}
+
+	size_t create(const ValueType & value = ValueType()){
+		size_t id;
+		if (!freeIds.empty()){
+			id = freeIds.back();
+			freeIds.pop_back();
+		}else{
+			id = rowOfId.size();
+			rowOfId.push_back(npos);
+		}
+		rowOfId[id] = idOfRow.size();
+		idOfRow.push_back(id);
+		for (size_t i = 0; i < columns.size(); i++){
+			columns[i]->append(value);
+		}
+		return id;
+	}
+
+	bool contains(size_t id) const{
+		return id < rowOfId.size() && rowOfId[id] != npos;
+	}
+
+	void remove(size_t id){
+		assert(contains(id));
+		const size_t row = rowOfId[id];
+		const size_t last = idOfRow.size() - 1;
+		for (size_t i = 0; i < columns.size(); i++){
+			columns[i]->move(last, row);
+			columns[i]->pop_back();
+		}
+		idOfRow[row] = idOfRow[last];
+		rowOfId[idOfRow[row]] = row;
+		idOfRow.pop_back();
+		rowOfId[id] = npos;
+		freeIds.push_back(id);
+	}
+
+	ValueType get(size_t id) const{
+		assert(contains(id));
+		ValueType value = ValueType();
+		for (size_t i = 0; i < columns.size(); i++){
+			columns[i]->load(rowOfId[id], value);
+		}
+		return value;
+	}
+
+	void set(size_t id, const ValueType & value){
+		assert(contains(id));
+		for (size_t i = 0; i < columns.size(); i++){
+			columns[i]->store(rowOfId[id], value);
+		}
+	}
+
+	size_t size() const{
+		return idOfRow.size();
+	}
+
+	// Contiguous storage of a field, indexed by row; see rowOf()
+	template< typename F >
+	F * column(F ValueType::* member){
+		for (size_t i = 0; i < columns.size(); i++){
+			TypedColumn< F > * typed = dynamic_cast< TypedColumn< F > * >(columns[i]);
+			if (typed && typed->member == member){
+				return typed->data.data();
+			}
+		}
+		return NULL;
+	}
+
+	size_t rowOf(size_t id) const{
+		assert(contains(id));
+		return rowOfId[id];
+	}
+
+/*
+  @ Register
+  Arguments:
+    * namespac - Namespace to load into
+
+  Description:
+    Creates the Lua table of the store. Leave namespac "" to load it into the global space.
+*/
+	void Register(const std::string & namespac = ""){
+		static const struct { const char * name; lutok::cxx_function function; } functions[] = {
+			{ "create", &store_create }, { "remove", &store_remove }, { "count", &store_count },
+			{ "ids", &store_ids }, { "get", &store_get }, { "set", &store_set }, { "apply", &store_apply },
+			{ "axpy", &store_axpy }, { "map", &store_map }, { "gather", &store_gather },
+			{ "scatter", &store_scatter },
+		};
+		const int count = sizeof(functions) / sizeof(functions[0]);
+		lua_createtable(static_cast< lua_State * >(state.getLuaState()), 0, count);
+		for (int i = 0; i < count; i++){
+			state.push_lightuserdata(static_cast< C * >(this));
+			state.push_cxx_closure(functions[i].function, 1);
+			state.raw_set_field(-2, functions[i].name);
+		}
+		if (!namespac.empty()){
+			state.get_global(namespac);
+			if (state.is_nil()){
+				state.pop(1);
+				state.new_table();
+				state.push_value();
+				state.set_global(namespac);
+			}
+			state.insert(-2);
+			state.set_field(-2, storeName);
+			state.pop(1);
+		}else{
+			state.set_global(storeName);
+		}
+	}
+
+private:
+	static C * self(lutok::state & s){
+		return static_cast< C * >(const_cast< void * >(s.to_lightuserdata(s.upvalue_index(1))));
+	}
+
+	static lua_State * raw(lutok::state & s){
+		return static_cast< lua_State * >(s.getLuaState());
+	}
+
+	size_t checkId(lua_State * L, int index){
+		const lua_Integer id = luaL_checkinteger(L, index);
+		if (id < 0 || !contains(static_cast< size_t >(id))){
+			luaL_argerror(L, index, "unknown id");
+		}
+		return static_cast< size_t >(id);
+	}
+
+	Column * checkField(lua_State * L, int index){
+		typename std::map< std::string, Column * >::const_iterator iter = columnNames.find(luaL_checkstring(L, index));
+		if (iter == columnNames.end()){
+			luaL_argerror(L, index, "unknown field");
+		}
+		return (*iter).second;
+	}
+
+	// Fills the selection with the rows of the ids array at index, returns NULL for all rows
+	const size_t * checkRows(lua_State * L, int index, size_t & n){
+		if (lua_isnoneornil(L, index)){
+			n = idOfRow.size();
+			return NULL;
+		}
+		luaL_checktype(L, index, LUA_TTABLE);
+		n = lua_objlen(L, index);
+		selection.resize(n);
+		for (size_t i = 0; i < n; i++){
+			lua_rawgeti(L, index, static_cast< int >(i + 1));
+			const lua_Number id = lua_tonumber(L, -1);
+			if (lua_type(L, -1) != LUA_TNUMBER || id != std::floor(id)){
+				luaL_argerror(L, index, lua_pushfstring(L, "integer id expected at position %d", static_cast< int >(i + 1)));
+			}
+			if (!lutok::detail::number_fits< size_t >(id) || !contains(static_cast< size_t >(id))){
+				luaL_error(L, "unknown id at position %d of the selection", static_cast< int >(i + 1));
+			}
+			selection[i] = rowOfId[static_cast< size_t >(id)];
+			lua_pop(L, 1);
+		}
+		return selection.data();
+	}
+
+	// Row of an id taken by map(), which the mapped function may have removed
+	size_t checkMapped(lua_State * L, size_t id){
+		if (!contains(id)){
+			luaL_error(L, "store modified during map: id %d was removed", static_cast< int >(id));
+		}
+		return rowOfId[id];
+	}
+
+	static Operation checkOperation(lua_State * L, int index){
+		static const char * const names[] = { "set", "add", "sub", "mul", "div", "min", "max", NULL };
+		return static_cast< Operation >(luaL_checkoption(L, index, NULL, names));
+	}
+
+	static int store_create(lutok::state & s){
+		lua_pushinteger(raw(s), static_cast< lua_Integer >(self(s)->create()));
+		return 1;
+	}
+
+	static int store_remove(lutok::state & s){
+		C * store = self(s);
+		store->remove(store->checkId(raw(s), 1));
+		return 0;
+	}
+
+	static int store_count(lutok::state & s){
+		lua_pushinteger(raw(s), static_cast< lua_Integer >(self(s)->size()));
+		return 1;
+	}
+
+	static int store_ids(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		const size_t n = store->idOfRow.size();
+		lua_createtable(L, static_cast< int >(n), 0);
+		for (size_t i = 0; i < n; i++){
+			lua_pushinteger(L, static_cast< lua_Integer >(store->idOfRow[i]));
+			lua_rawseti(L, -2, static_cast< int >(i + 1));
+		}
+		return 1;
+	}
+
+	static int store_get(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		const size_t id = store->checkId(L, 1);
+		store->checkField(L, 2)->push(L, store->rowOfId[id]);
+		return 1;
+	}
+
+	static int store_set(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		const size_t id = store->checkId(L, 1);
+		store->checkField(L, 2)->set(L, 3, store->rowOfId[id]);
+		return 0;
+	}
+
+	static int store_apply(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		Column * column = store->checkField(L, 1);
+		const Operation op = checkOperation(L, 2);
+		size_t n;
+		const size_t * rows = store->checkRows(L, 4, n);
+		if (lua_type(L, 3) == LUA_TSTRING){
+			if (!column->apply(op, *store->checkField(L, 3), 1, rows, n)){
+				luaL_argerror(L, 3, "fields of different types");
+			}
+		}else{
+			const lua_Number operand = luaL_checknumber(L, 3);
+			if (!column->fits(operand)){
+				luaL_argerror(L, 3, "number out of the range of the field");
+			}
+			if (!column->apply(op, operand, rows, n)){
+				luaL_argerror(L, 3, "integer division by zero");
+			}
+		}
+		return 0;
+	}
+
+	static int store_axpy(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		Column * column = store->checkField(L, 1);
+		Column * source = store->checkField(L, 2);
+		const lua_Number k = luaL_checknumber(L, 3);
+		size_t n;
+		const size_t * rows = store->checkRows(L, 4, n);
+		if (!column->apply(OpAdd, *source, k, rows, n)){
+			luaL_argerror(L, 2, "fields of different types");
+		}
+		return 0;
+	}
+
+	static int store_map(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		Column * column = store->checkField(L, 1);
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		size_t n;
+		const size_t * rows = store->checkRows(L, 3, n);
+		// The function may call back into the store, which reuses the selection and moves rows
+		// around: work on a snapshot of the ids, held by a userdata so errors don't leak it
+		size_t * ids = static_cast< size_t * >(lua_newuserdata(L, n * sizeof(size_t)));
+		for (size_t i = 0; i < n; i++){
+			ids[i] = store->idOfRow[rows ? rows[i] : i];
+		}
+		for (size_t i = 0; i < n; i++){
+			lua_pushvalue(L, 2);
+			column->push(L, store->checkMapped(L, ids[i]));
+			lua_call(L, 1, 1);
+			column->set(L, -1, store->checkMapped(L, ids[i]));
+			lua_pop(L, 1);
+		}
+		return 0;
+	}
+
+	static int store_gather(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		Column * column = store->checkField(L, 1);
+		size_t n;
+		const size_t * rows = store->checkRows(L, 2, n);
+		lua_createtable(L, static_cast< int >(n), 0);
+		for (size_t i = 0; i < n; i++){
+			column->push(L, rows ? rows[i] : i);
+			lua_rawseti(L, -2, static_cast< int >(i + 1));
+		}
+		return 1;
+	}
+
+	static int store_scatter(lutok::state & s){
+		C * store = self(s);
+		lua_State * L = raw(s);
+		Column * column = store->checkField(L, 1);
+		luaL_checktype(L, 2, LUA_TTABLE);
+		size_t n;
+		const size_t * rows = store->checkRows(L, 3, n);
+		if (lua_objlen(L, 2) < n){
+			luaL_argerror(L, 2, "not enough values");
+		}
+		for (size_t i = 0; i < n; i++){
+			lua_rawgeti(L, 2, static_cast< int >(i + 1));
+			column->set(L, -1, rows ? rows[i] : i);
+			lua_pop(L, 1);
+		}
+		return 0;
+	}
+};
+
+template< class C, typename V >
+const size_t LComponentStore< C, V >::npos;
+
+}
+#endif
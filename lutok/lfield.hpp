@@ -0,0 +1,79 @@
+#if !defined(LUTOK_LFIELD_HPP)
+#define LUTOK_LFIELD_HPP
+
+#include <cmath>
+#include <string>
+#include <type_traits>
+
+#include <lua.hpp>
+#include <lutok/bind.hpp>
+#include <lutok/state.hpp>
+
+namespace lutok {
+
+/*
+  LField holds the accessors generated for a data member of a wrapped type, shared by LObject and
+  LHandle through LOBJECT_ADD_FIELD and LOBJECT_MEMBER_FIELD. F is the type of the member pointer
+  and Field the member itself.
+*/
+template< typename F, F Field >
+struct LField;
+
+template< typename V, typename M, M V::* Field >
+struct LField< M V::*, Field > {
+	static_assert(std::is_arithmetic< M >::value || std::is_same< M, std::string >::value,
+		"Only arithmetic, bool and std::string data members can be bound");
+	typedef M FieldType;
+
+/*
+  @ get
+  Arguments:
+    * L - Lua State
+	obj	- Wrapped object
+
+  Description:
+    Pushes the value of the member.
+*/
+	static int get(lutok::state & s, V * obj){
+		lutok::detail::stack_value< FieldType >::push(static_cast< lua_State * >(s.getLuaState()), obj->*Field);
+		return 1;
+	}
+
+/*
+  @ set
+  Arguments:
+    * L - Lua State
+	obj	- Wrapped object
+	className	- Lua name of the class, for error messages
+
+  Description:
+    Stores the value at index 1 in the member. Fractional or out of range numbers assigned to
+	integral members raise an error instead of storing a truncated value.
+*/
+	static int set(lutok::state & s, V * obj, const std::string & className){
+		lua_State * L = static_cast< lua_State * >(s.getLuaState());
+		check(s, L, className, std::integral_constant< bool,
+			std::is_integral< FieldType >::value && !std::is_same< FieldType, bool >::value >());
+		obj->*Field = lutok::detail::stack_value< FieldType >::get(L, 1);
+		return 0;
+	}
+
+private:
+	static void check(lutok::state &, lua_State *, const std::string &, std::false_type){
+	}
+
+	static void check(lutok::state & s, lua_State * L, const std::string & className, std::true_type){
+		if (!lua_isnumber(L, 1)){
+			s.error("Bad value for a field of %s (number expected, got %s)", className.c_str(), luaL_typename(L, 1));
+		}
+		const lua_Number value = lua_tonumber(L, 1);
+		if (value != std::floor(value)){
+			s.error("Bad value for a field of %s (integer expected)", className.c_str());
+		}else if (!lutok::detail::number_fits< FieldType >(value)){
+			s.error("Bad value for a field of %s (number out of range)", className.c_str());
+		}
+	}
+};
+
+}
+#endif
@@ -0,0 +1,148 @@
+#include <cassert>
+
+#include <lua.hpp>
+
+#include "c_gate.hpp"
+#include "exceptions.hpp"
+#include "state.ipp"
+#include "lhandle.hpp"
+
+namespace lutok {
+
+namespace {
+
+/// Registry key of the per-state class list of light handle classes.
+char classesKey;
+
+/// Tag stored in the lowest bits of every handle.
+const size_t handleTag = 3;
+
+}  // anonymous namespace
+
+void * LHandleClass::encode(size_t id, size_t generation, size_t index){
+	assert(id <= mask(IdBits) && generation <= mask(GenerationBits) && index <= mask(IndexBits));
+	const size_t bits = handleTag | (id << TagBits) | (generation << (TagBits + IdBits))
+		| (index << (TagBits + IdBits + GenerationBits));
+	return reinterpret_cast<void *>(bits);
+}
+
+bool LHandleClass::decode(const void * handle, size_t & id, size_t & generation, size_t & index){
+	const size_t bits = reinterpret_cast<size_t>(handle);
+	if ((bits & handleTag) != handleTag){
+		return false;
+	}
+	id = (bits >> TagBits) & mask(IdBits);
+	generation = (bits >> (TagBits + IdBits)) & mask(GenerationBits);
+	index = bits >> (TagBits + IdBits + GenerationBits);
+	return true;
+}
+
+// Pushes the class list, installing it together with the light userdata
+// metatable the first time a handle class is registered in the state.
+void LHandleClass::pushClasses(lutok::state & s){
+	lua_State * L = state_c_gate(s).c_state();
+	lua_pushlightuserdata(L, &classesKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_istable(L, -1)){
+		return;
+	}
+	lua_pop(L, 1);
+
+	lua_pushlightuserdata(L, NULL);
+	if (lua_getmetatable(L, -1)){
+		lua_pop(L, 2);
+		throw lutok::error("Light userdata already have a metatable in this Lua state");
+	}
+	lua_newtable(L);	// classes
+	lua_pushlightuserdata(L, &classesKey);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+
+	lua_newtable(L);	// metatable
+	lua_pushvalue(L, -2);
+	s.push_cxx_closure(dispatch_index, 1);
+	s.raw_set_field(-2, "__index");
+	lua_pushvalue(L, -2);
+	s.push_cxx_closure(dispatch_newindex, 1);
+	s.raw_set_field(-2, "__newindex");
+	lua_pushvalue(L, -2);
+	s.push_cxx_closure(dispatch_tostring, 1);
+	s.raw_set_field(-2, "__tostring");
+	lua_setmetatable(L, -3);
+	lua_remove(L, -2);	// light userdata
+}
+
+size_t LHandleClass::registerClass(lutok::state & s, LHandleClass * instance){
+	lua_State * L = state_c_gate(s).c_state();
+	assert(lua_istable(L, -1));
+	lua_pushlightuserdata(L, instance);
+	lua_rawseti(L, -2, 0);
+
+	pushClasses(s);
+	const size_t id = lua_objlen(L, -1) + 1;
+	if (id > mask(IdBits)){
+		lua_pop(L, 2);
+		throw lutok::error("Too many light handle classes");
+	}
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, static_cast<int>(id));
+	lua_pop(L, 2);
+	return id;
+}
+
+int LHandleClass::dispatch(lutok::state & s, bool set){
+	lua_State * L = state_c_gate(s).c_state();
+	const void * handle = lua_touserdata(L, 1);
+	size_t id, generation, index;
+	if (!decode(handle, id, generation, index)){
+		s.error("attempt to index a light userdata value");
+	}
+	lua_rawgeti(L, lua_upvalueindex(1), static_cast<int>(id));
+	if (!lua_istable(L, -1)){
+		s.error("attempt to index an invalid handle");
+	}
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+
+	if (lua_isnumber(L, -1)){	// property slot
+		const int slot = static_cast<int>(lua_tointeger(L, -1));
+		lua_rawgeti(L, -2, 0);
+		LHandleClass * instance = static_cast<LHandleClass *>(lua_touserdata(L, -1));
+		lua_pop(L, 3);
+		lua_remove(L, 1);	// handle
+		lua_remove(L, 1);	// key
+		return instance->access_property(s, handle, slot, set);
+	}
+	if (set){
+		s.error("Trying to set the unknown or method member [%s] of a handle", lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : luaL_typename(L, 2));
+	}
+	return 1;	// method closure or nil
+}
+
+int LHandleClass::dispatch_index(lutok::state & s){
+	return dispatch(s, false);
+}
+
+int LHandleClass::dispatch_newindex(lutok::state & s){
+	return dispatch(s, true);
+}
+
+int LHandleClass::dispatch_tostring(lutok::state & s){
+	lua_State * L = state_c_gate(s).c_state();
+	const void * handle = lua_touserdata(L, 1);
+	size_t id, generation, index;
+	if (decode(handle, id, generation, index)){
+		lua_rawgeti(L, lua_upvalueindex(1), static_cast<int>(id));
+		if (lua_istable(L, -1)){
+			lua_rawgeti(L, -1, 0);
+			LHandleClass * instance = static_cast<LHandleClass *>(lua_touserdata(L, -1));
+			lua_pop(L, 2);
+			return instance->to_string(s, handle);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushfstring(L, "userdata: %p", handle);
+	return 1;
+}
+
+}
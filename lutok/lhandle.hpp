@@ -0,0 +1,309 @@
+#if !defined(LUTOK_LHANDLE_HPP)
+#define LUTOK_LHANDLE_HPP
+
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <lua.hpp>
+#include <lutok/exceptions.hpp>
+#include <lutok/lobject.hpp>
+#include <type_traits>
+
+#define LOBJECT_DEFINE_HANDLE_CLASS(CLASSNAME, VALUETYPE, LUANAME) CLASSNAME(lutok::state & state) : LHandle<CLASSNAME, VALUETYPE>::LHandle( state, (LUANAME))
+
+namespace lutok {
+
+/*
+  LHandleClass is the type independent part of LHandle. Handles are light userdata, which share a
+  single metatable per Lua state, so its metamethods find the class by the id encoded in the handle.
+  Installing that metatable claims the light userdata metatable of the state; light userdata which
+  are not handles can still be used as table keys and values, but cannot be indexed.
+
+  Handle layout, from the lowest bit: a two bit tag, the class id, the generation of the slot and
+  the slot index.
+*/
+class LHandleClass {
+public:
+	virtual ~LHandleClass() {};
+
+	static const unsigned TagBits = 2;
+	static const unsigned IdBits = sizeof(void *) >= 8 ? 14 : 6;
+	static const unsigned GenerationBits = sizeof(void *) >= 8 ? 16 : 8;
+	static const unsigned IndexBits = sizeof(void *) * 8 - TagBits - IdBits - GenerationBits;
+
+	static void * encode(size_t id, size_t generation, size_t index);
+	static bool decode(const void * handle, size_t & id, size_t & generation, size_t & index);
+
+	static size_t mask(unsigned bits){
+		return (size_t(1) << bits) - 1;
+	}
+
+	virtual int access_property(lutok::state & s, const void * handle, int index, bool set) = 0;
+	virtual int to_string(lutok::state & s, const void * handle) = 0;
+
+protected:
+	// Adds the class table on top of the stack to the class list of the state and pops it
+	static size_t registerClass(lutok::state & s, LHandleClass * instance);
+
+private:
+	static void pushClasses(lutok::state & s);
+	static int dispatch(lutok::state & s, bool set);
+	static int dispatch_index(lutok::state & s);
+	static int dispatch_newindex(lutok::state & s);
+	static int dispatch_tostring(lutok::state & s);
+};
+
+
+/*
+  LHandle exposes values of type V to Lua as light userdata handles instead of full userdata. The
+  values live in a dense table owned by the class instance, so creating an object allocates nothing
+  on the Lua side and the collector never sees it. Handles do not keep their object alive: objects
+  are destroyed explicitly with destroy(), after which every handle to them is stale and check()
+  raises an error, detected through the generation stored in the handle. The generation wraps
+  around after 2^GenerationBits reuses of a slot.
+
+  Methods and properties are declared as with LObject, with LOBJECT_ADD_METHOD, LOBJECT_ADD_PROPERTY
+  and LOBJECT_ADD_FIELD; operators are not supported. Pointers returned by check() and create()
+  remain valid until the next create().
+*/
+template <class C, typename V>
+class LHandle: public LSingleton<C>, public LHandleClass {
+protected:
+	lutok::state state;
+public:
+	typedef V * T;
+	typedef V ValueType;
+	typedef int (C::*Method) (lutok::state &, T);
+	typedef struct std::pair< Method, Method > PropertyPair;
+
+	typedef std::map< std::string, PropertyPair > PropertyType;
+	typedef std::map< std::string, Method > FunctionType;
+
+	std::string className;
+
+protected:
+	PropertyType properties;
+	FunctionType methods;
+
+	LHandle(lutok::state & state, const std::string & className)
+		: state(state.getMainLuaState()), className(className), classId(0), liveCount(0){
+	}
+
+private:
+	size_t classId;
+	size_t liveCount;
+	std::vector< ValueType > values;
+	std::vector< size_t > generations;
+	std::vector< bool > alive;
+	std::vector< size_t > freeSlots;
+
+	std::vector< PropertyPair > PropertyCache;
+	std::vector< Method > MethodCache;
+
+	void pushHandle(lutok::state & s, size_t index){
+		s.push_lightuserdata(encode(classId, generations[index], index));
+	}
+
+	size_t indexOf(T obj) const{
+		assert(obj >= values.data() && obj < values.data() + values.size());
+		return static_cast<size_t>(obj - values.data());
+	}
+
+	// Returns the live object of a handle of this class, or nullptr
+	T resolve(const void * handle){
+		size_t id, generation, index;
+		if (!decode(handle, id, generation, index) || id != classId){
+			return nullptr;
+		}
+		if (index >= values.size() || !alive[index] || generations[index] != generation){
+			return nullptr;
+		}
+		return &values[index];
+	}
+
+public:
+
+/*
+  @ check
+  Arguments:
+    * s - Lua State holding the argument
+    * narg - Position to check
+
+  Description:
+    Retrieves the object of the handle passed at narg. Raises an error if the argument is not a
+	handle of this class or if its object has been destroyed. Functions called from Lua pass
+	their own state, which differs from the one of the class inside coroutines.
+*/
+	T check(lutok::state & s, int narg){
+		T obj = nullptr;
+		if (lua_islightuserdata(static_cast< lua_State * >(s.getLuaState()), narg)){
+			obj = resolve(s.to_lightuserdata(narg));
+		}
+		if (!obj){
+			s.error("bad argument #%d (live %s handle expected)", narg, className.c_str());
+		}
+		return obj;
+	}
+
+	// Checks an argument on the stack of the main thread
+	T check(int narg){
+		return check(state, narg);
+	}
+
+/*
+  @ create
+  Arguments:
+	s	- Lua State to push onto
+	args	- Constructor arguments of the value
+
+  Description:
+    Constructs a new object in the table and pushes its handle onto the Lua stack. Functions
+	called from Lua pass the state they were given, which is the calling coroutine.
+*/
+	template< typename... Args >
+	T create(lutok::state & s, Args&&... args){
+		if (!classId){
+			Register();
+		}
+		size_t index;
+		if (!freeSlots.empty()){
+			index = freeSlots.back();
+			values[index] = ValueType(std::forward<Args>(args)...);
+			freeSlots.pop_back();
+		}else{
+			if (values.size() > mask(IndexBits)){
+				throw lutok::error("Too many objects of class " + className);
+			}
+			index = values.size();
+			values.emplace_back(std::forward<Args>(args)...);
+			generations.push_back(0);
+			alive.push_back(false);
+		}
+		alive[index] = true;
+		liveCount++;
+		pushHandle(s, index);
+		return &values[index];
+	}
+
+	// Pushes onto the stack of the main thread, for C++ code outside of calls from Lua
+	template< typename... Args >
+	T create(Args&&... args){
+		return create(state, std::forward<Args>(args)...);
+	}
+
+/*
+  @ push
+  Arguments:
+	s	- Lua State to push onto
+	obj	- Object of this class
+
+  Description:
+    Pushes a handle to an object previously returned by create() or check().
+*/
+	void push(lutok::state & s, T obj){
+		size_t index = indexOf(obj);
+		assert(alive[index]);
+		pushHandle(s, index);
+	}
+
+	void push(T obj){
+		push(state, obj);
+	}
+
+/*
+  @ destroy
+  Arguments:
+	obj	- Object of this class
+
+  Description:
+    Destroys the object, replacing it with a default constructed value, and invalidates its handles.
+*/
+	void destroy(T obj){
+		size_t index = indexOf(obj);
+		assert(alive[index]);
+		values[index] = ValueType();
+		alive[index] = false;
+		generations[index] = (generations[index] + 1) & mask(GenerationBits);
+		freeSlots.push_back(index);
+		liveCount--;
+	}
+
+	size_t size() const{
+		return liveCount;
+	}
+
+	void Register(){
+		if (classId){
+			return;
+		}
+		PropertyCache.clear();
+		MethodCache.clear();
+
+		state.new_table();
+		int classtable = state.get_top();
+		int i = 0;
+		for (typename PropertyType::const_iterator iter = properties.begin(); iter != properties.end(); iter++, i++){
+			state.push_string((*iter).first);
+			state.push_integer(i);
+			state.raw_set(classtable);
+			PropertyCache.push_back((*iter).second);
+		}
+		i = 0;
+		for (typename FunctionType::const_iterator iter = methods.begin(); iter != methods.end(); iter++, i++){
+			state.push_string((*iter).first);
+			state.push_integer(i);
+			state.push_lightuserdata(static_cast<C*>(this));
+			state.push_cxx_closure(function_dispatch, 2);
+			state.raw_set(classtable);
+			MethodCache.push_back((*iter).second);
+		}
+		classId = registerClass(state, this);
+	}
+
+	virtual int access_property(lutok::state & s, const void * handle, int index, bool set){
+		T obj = resolve(handle);
+		if (!obj){
+			s.error("Stale %s handle", className.c_str());
+		}
+		const PropertyPair & fpairs = PropertyCache[index];
+		return (static_cast<C*>(this)->*(set ? fpairs.second : fpairs.first)) (s, obj);
+	}
+
+	virtual int to_string(lutok::state & s, const void * handle){
+		size_t id, generation, index;
+		decode(handle, id, generation, index);
+		char c[128];
+		sprintf(c, "%s #%lu%s", className.c_str(), static_cast<unsigned long>(index), resolve(handle) ? "" : " (stale)");
+		s.push_string(c);
+		return 1;
+	}
+
+	template< typename F, F Field >
+	int field_getter(lutok::state & s, T obj){
+		return LField< F, Field >::get(s, obj);
+	}
+
+	template< typename F, F Field >
+	int field_setter(lutok::state & s, T obj){
+		return LField< F, Field >::set(s, obj, className);
+	}
+
+/*
+  @ function_dispatch (internal)
+  Arguments:
+    * L - Lua State
+*/
+	static int function_dispatch(lutok::state & s) {
+		int i = s.to_integer(s.upvalue_index(1));
+		C * thisobj = static_cast<C *>(const_cast<void *>(s.to_lightuserdata(s.upvalue_index(2))));
+		T obj = thisobj->check(s, 1);	// self
+		return (thisobj->*(thisobj->MethodCache[i])) (s, obj);
+	}
+};
+
+}
+#endif
@@ -2,21 +2,36 @@
 #define LUTOK_LOBJECT_HPP
 
 #include <cassert>
+#include <cstring>
 #include <string>
 #include <utility>
+#include <deque>
 #include <map>
+#include <vector>
 
 #include <lua.hpp>
+#include <lutok/bind.hpp>
+#include <lutok/lfield.hpp>
+#include <new>
 #include <string>
 #include <tuple>
 #include <type_traits>
-#include <mutex>
 
-#define LOBJECT_ADD_PROPERTY(CLASSNAME, TYPENAME, LUANAME, GETTER, SETTER) this->properties[(LUANAME)] = LObject<CLASSNAME, TYPENAME>::PropertyPair(&CLASSNAME::GETTER, &CLASSNAME::SETTER)
+#define LOBJECT_ADD_PROPERTY(CLASSNAME, TYPENAME, LUANAME, GETTER, SETTER) this->properties[(LUANAME)] = CLASSNAME::PropertyPair(&CLASSNAME::GETTER, &CLASSNAME::SETTER)
+#define LOBJECT_ADD_FIELD(CLASSNAME, LUANAME, FIELD) this->properties[(LUANAME)] = CLASSNAME::PropertyPair(LOBJECT_FIELD_ACCESSORS(CLASSNAME, FIELD))
 #define LOBJECT_ADD_METHOD(CLASSNAME, LUANAME, METHOD) this->methods[(LUANAME)] = &CLASSNAME::METHOD
 #define LOBJECT_ADD_OPERATOR(CLASSNAME, LUAOPERATORNAME) this->methods["operator_"#LUAOPERATORNAME] = &CLASSNAME::operator_##LUAOPERATORNAME
 
+#define LOBJECT_MEMBERS(CLASSNAME) static const CLASSNAME::Member * describeMembers(size_t & count){ static constexpr CLASSNAME::Member members[] = {
+#define LOBJECT_MEMBERS_END }; count = sizeof(members) / sizeof(members[0]); return members; }
+#define LOBJECT_MEMBER_PROPERTY(CLASSNAME, LUANAME, GETTER, SETTER) { (LUANAME), CLASSNAME::MemberProperty, nullptr, &CLASSNAME::GETTER, &CLASSNAME::SETTER }
+#define LOBJECT_MEMBER_FIELD(CLASSNAME, LUANAME, FIELD) { (LUANAME), CLASSNAME::MemberProperty, nullptr, LOBJECT_FIELD_ACCESSORS(CLASSNAME, FIELD) }
+#define LOBJECT_FIELD_ACCESSORS(CLASSNAME, FIELD) &CLASSNAME::field_getter<decltype(&CLASSNAME::ValueType::FIELD), &CLASSNAME::ValueType::FIELD>, &CLASSNAME::field_setter<decltype(&CLASSNAME::ValueType::FIELD), &CLASSNAME::ValueType::FIELD>
+#define LOBJECT_MEMBER_METHOD(CLASSNAME, LUANAME, METHOD) { (LUANAME), CLASSNAME::MemberMethod, &CLASSNAME::method_stub<&CLASSNAME::METHOD>, &CLASSNAME::METHOD, nullptr }
+#define LOBJECT_MEMBER_OPERATOR(CLASSNAME, LUAOPERATORNAME) { "operator_"#LUAOPERATORNAME, CLASSNAME::MemberOperator, &CLASSNAME::method_stub<&CLASSNAME::operator_##LUAOPERATORNAME>, &CLASSNAME::operator_##LUAOPERATORNAME, nullptr }
+
 #define LOBJECT_DEFINE_CLASS(CLASSNAME, TYPENAME, LUANAME) CLASSNAME(lutok::state & state) : LObject<CLASSNAME, TYPENAME>::LObject( state, (LUANAME))
+#define LOBJECT_DEFINE_DERIVED_CLASS(CLASSNAME, TYPENAME, BASECLASS, LUANAME) CLASSNAME(lutok::state & state) : LObject<CLASSNAME, TYPENAME, BASECLASS>::LObject( state, (LUANAME))
 #define LOBJECT_INSTANCE(CLASSNAME) (CLASSNAME::getInstance(state))
 #define LOBJECT_METHOD(METHODNAME, TYPEDEF) METHODNAME(lutok::state & state, TYPEDEF)
 #define LOBJECT_OPERATOR(OPERATORNAME, TYPEDEF) operator_##OPERATORNAME(lutok::state & state, TYPEDEF)
@@ -25,18 +40,27 @@
 
 namespace lutok {
 
+/*
+  LSingleton keeps one instance of C per Lua state rather than per process. The instance is owned
+  by a userdata stored in the registry of the state, so independent Lua states (e.g. one per thread)
+  get their own class descriptors and method tables and share no mutable data. The instance is
+  destroyed when its Lua state is closed.
+*/
 template <class C>
 class LSingleton {
 public:
 	virtual ~LSingleton() {};
 	static inline C & getInstance(lutok::state & state);
 private:
-	static std::unique_ptr<C> m_instance;
-	static std::once_flag m_onceFlag;
+	static char m_registryKey;
+	static int collectInstance(lutok::state & s);
 	LSingleton& operator=(const C& rhs);
 protected:
 	LSingleton(void) {};
 	LSingleton(const C& src) {};
+
+	// Called while the Lua state is being closed, right before the instance is deleted
+	virtual void releaseInstance() {};
 };
 
 /*
@@ -55,8 +79,107 @@ protected:
 };
 */
 
+/*
+  LPool hands out fixed-size records from slabs of slabSize records and recycles released ones
+  through a free list, so high churn of wrapped objects neither fragments the heap nor goes
+  through malloc on every push and collection. A pool belongs to a class instance, hence to a
+  single Lua state, and needs no locking. Slabs are only freed with the pool.
+*/
+template <typename Type>
+class LPool {
+public:
+	explicit LPool(size_t slabSize = 64)
+		: slabSize(slabSize), freeList(NULL), liveCount(0), peakCount(0), reservedCount(0) {}
 
-template <class C, typename T>
+	~LPool(){
+		for (size_t i = 0; i < slabs.size(); i++){
+			delete[] slabs[i];
+		}
+	}
+
+	template< typename... Args >
+	Type * allocate(Args&&... args){
+		if (!freeList){
+			grow();
+		}
+		Slot * slot = freeList;
+		freeList = slot->next;
+		Type * result;
+		try{
+			result = new (&slot->storage) Type(std::forward<Args>(args)...);
+		}catch(...){
+			slot->next = freeList;
+			freeList = slot;
+			throw;
+		}
+		liveCount++;
+		if (liveCount > peakCount){
+			peakCount = liveCount;
+		}
+		return result;
+	}
+
+	void release(Type * object){
+		object->~Type();
+		Slot * slot = reinterpret_cast<Slot *>(object);
+		slot->next = freeList;
+		freeList = slot;
+		liveCount--;
+	}
+
+	// Takes effect for slabs allocated from now on
+	void setSlabSize(size_t size){
+		assert(size > 0);
+		slabSize = size;
+	}
+
+	size_t live() const{
+		return liveCount;
+	}
+
+	size_t peak() const{
+		return peakCount;
+	}
+
+	size_t bytes() const{
+		return reservedCount * sizeof(Slot);
+	}
+
+private:
+	union Slot {
+		Slot * next;
+		typename std::aligned_storage< sizeof(Type), std::alignment_of<Type>::value >::type storage;
+	};
+
+	void grow(){
+		Slot * slab = new Slot[slabSize];
+		slabs.push_back(slab);
+		reservedCount += slabSize;
+		for (size_t i = slabSize; i > 0; i--){
+			slab[i - 1].next = freeList;
+			freeList = &slab[i - 1];
+		}
+	}
+
+	size_t slabSize;
+	Slot * freeList;
+	std::vector< Slot * > slabs;
+	size_t liveCount;
+	size_t peakCount;
+	size_t reservedCount;
+
+	LPool(const LPool &);
+	LPool & operator=(const LPool &);
+};
+
+
+/*
+  LObject wraps values of type T (a pointer) under the Lua class C. Base names the LObject class
+  wrapping a base type of T, declared with LOBJECT_DEFINE_DERIVED_CLASS. Its members are copied
+  down into the metatable of C at registration, so a lookup is a single probe at any depth, and
+  check() of every ancestor accepts instances of C and upcasts them.
+*/
+template <class C, typename T, class Base = void>
 class LObject: public LSingleton<C> {
 protected:
 	lutok::state state;
@@ -68,14 +191,48 @@ public:
 	typedef std::shared_ptr<T> typeSharedPtr;
 
 	typedef int (C::*Method) (lutok::state &, T);
+	typedef Base BaseClass;
+	typedef void * (*UpcastFunction)(void *);
+
+	// Identifies this class in the metatables of derived classes
+	static char classKey;
 	typedef std::tuple< C *, T, bool> LObjectTuple;
+	typedef typename std::remove_pointer<T>::type ValueType;
+
+	// Userdata layout of objects created by emplace(): the usual tuple
+	// pointer refers to the tuple right after it and T points to the value
+	// stored at the end of the very same block. The header alone is enough to
+	// recognize such a block, so classes wrapping abstract or incomplete types
+	// only need the complete layout if they call emplace().
+	struct EmbeddedHeader {
+		LObjectTuple * tuple;
+		LObjectTuple header;
+	};
+
+	template< typename V >
+	struct EmbeddedObject {
+		EmbeddedHeader prefix;
+		V value;
+	};
 	typedef struct std::pair< Method, Method > PropertyPair;
 
+	enum MemberKind { MemberProperty, MemberMethod, MemberOperator };
+
+	// Compile-time member descriptor, see LOBJECT_MEMBERS.
+	struct Member {
+		const char * name;
+		MemberKind kind;
+		lutok::cxx_function stub;	// Dispatch stub of methods and operators
+		Method first;				// Getter, method or operator
+		Method second;				// Setter
+	};
+
     typedef std::map< std::string, PropertyPair > PropertyType;
 	typedef std::map< std::string, Method > FunctionType;
 
-	typedef std::map< int, const PropertyPair *> PropertyCacheType;
-	typedef std::map< int, Method > MethodCacheType;
+	// Dispatch tables indexed directly by the slot ids stored in the metatable
+	typedef std::vector< PropertyPair > PropertyCacheType;
+	typedef std::vector< Method > MethodCacheType;
 
 	std::string className;
 
@@ -91,40 +248,193 @@ protected:
 	PropertyType properties;
 	FunctionType methods;
 
-	LObject(lutok::state & state, const std::string & className){
-		this->state = state;
-		this->className = className;
+	// The instance lives inside the Lua state it was created for, so it only
+	// keeps a borrowed handle: owning it would close the state from its own
+	// finalizer. The handle is to the main thread, as the instance may first
+	// be reached from a coroutine that ends long before the state does.
+	LObject(lutok::state & state, const std::string & className)
+		: state(state.getMainLuaState()), className(className), classMetatable(nullptr),
+		identityCacheEnabled(false), identityCacheHits(0), identityCacheMisses(0),
+		deferredDestruction(false), deferredLimit(0), deferredPeak(0), deferredForced(0),
+		destroyEmbedded(nullptr){
 	}
 
 private:
+	// Property of an ancestor, reached through the access_property() of the class it belongs to
+	struct InheritedProperty {
+		int (*access)(lutok::state &, void *, int, bool, T);
+		void * base;
+		int index;
+	};
+
 	PropertyCacheType PropertyCache;
 	MethodCacheType MethodCache;
+	std::vector< InheritedProperty > InheritedPropertyCache;
+
+	// Address of the metatable, which the registry keeps alive for the lifetime of the state.
+	// check() compares against it instead of looking the metatable up by name.
+	const void * classMetatable;
+
+	bool identityCacheEnabled;
+	size_t identityCacheHits;
+	size_t identityCacheMisses;
+
+	LPool< LObjectTuple > TuplePool;
+
+	bool deferredDestruction;
+	size_t deferredLimit;
+	size_t deferredPeak;
+	size_t deferredForced;
+	std::deque< T > DeferredQueue;
+
+	void defer(lutok::state & s, T obj){
+		if (DeferredQueue.size() >= deferredLimit){
+			// Backlog is full, the oldest object is destroyed right away, on the collecting state
+			deferredForced++;
+			drain(s, 1);
+		}
+		DeferredQueue.push_back(obj);
+		if (DeferredQueue.size() > deferredPeak){
+			deferredPeak = DeferredQueue.size();
+		}
+	}
 
 	LObjectTuple * getObjPair(T obj, bool managed){
-		return new LObjectTuple(reinterpret_cast<C*>(this), obj, managed);
+		return TuplePool.allocate(reinterpret_cast<C*>(this), obj, managed);
+	}
+
+	static bool isEmbedded(LObjectTuple ** obj){
+		return *obj == &(reinterpret_cast<EmbeddedHeader *>(obj)->header);
+	}
+
+	// Destroys the value of a block made by emplace(), set by the first emplace()
+	void (*destroyEmbedded)(LObjectTuple **);
+
+	template< typename V >
+	static void destroyEmbeddedValue(LObjectTuple ** obj){
+		reinterpret_cast<EmbeddedObject< V > *>(obj)->value.~V();
+	}
+
+	// Sets the class metatable on the userdata on top of the stack of s
+	void setClassMetatable(lutok::state & s){
+		s.get_metatable(className);
+		if (s.is_nil()){
+			s.pop(1);
+			Register();	// leaves the metatable on the class state
+			state.pop(1);
+			s.get_metatable(className);
+		}
+		s.set_metatable();
+	}
+
+	// Pushes the weak valued table mapping wrapped pointers to their userdata.
+	// The table lives in the registry under the address of this class instance.
+	void pushIdentityCache(lutok::state & s){
+		s.push_lightuserdata(&identityCacheEnabled);
+		s.raw_get(lutok::registry_index);
+		if (!s.is_table()){
+			s.pop(1);
+			s.new_table();
+			s.new_table();
+			s.raw_set_field("__mode", "v", -3);
+			s.set_metatable();
+			s.push_lightuserdata(&identityCacheEnabled);
+			s.push_value(-2);
+			s.raw_set(lutok::registry_index);
+		}
+	}
+
+	// Installs the metamethod matching an operator_* method, bound directly to
+	// its MethodCache slot. Classes only get the metamethods they define, so
+	// unset operators fall back to plain Lua semantics.
+	void setMetamethod(const char * methodName, int slot, int metatable){
+		static const char * const operators[][2] = {
+			{ "operator_add", "__add" }, { "operator_sub", "__sub" }, { "operator_mul", "__mul" },
+			{ "operator_div", "__div" }, { "operator_mod", "__mod" }, { "operator_pow", "__pow" },
+			{ "operator_unm", "__unm" }, { "operator_concat", "__concat" }, { "operator_len", "__len" },
+			{ "operator_eq", "__eq" }, { "operator_lt", "__lt" }, { "operator_le", "__le" },
+			{ "operator_call", "__call" },
+		};
+		if (std::strncmp(methodName, "operator_", 9) != 0){
+			return;
+		}
+		for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++){
+			if (std::strcmp(methodName, operators[i][0]) == 0){
+				state.push_integer(slot);
+				state.push_lightuserdata(static_cast<C*>(this));
+				state.push_value(metatable);
+				state.push_cxx_closure(operator_dispatch, 3);
+				state.raw_set_field(metatable, operators[i][1]);
+				return;
+			}
+		}
+	}
+
+	static void * identityKey(T obj){
+		return const_cast<void *>(static_cast<const void *>(obj));
 	}
 public:
 
 /*
   @ check
   Arguments:
-    * L - Lua State
+    * s - Lua State the call arrived on
     * narg - Position to check
 
   Description:
     Retrieves a wrapped class from the arguments passed to the func, specified by narg (position).
-    This func will raise an exception if the argument is not of the correct type.
+    This func will raise an exception if the argument is not of the correct type. Functions called
+	from Lua must pass the state they were given: inside a coroutine it is not the state the class
+	instance was created with.
 */
-    T check(int narg)
+    T check(lutok::state & s, int narg)
 	{
-		LObjectTuple ** obj = state.check_userdata<LObjectTuple *>(narg, className);
-		if ( obj 
-			//&& (std::is_class<std::get<1>(**obj)>::value == true)
-			//&& (std::is_class<(*obj)->second>::value == true)
-		){
-			return std::get<1>(**obj);		// pointer to T object
-		}else
-			return nullptr; // lightcheck returns nullptr if not found.
+		lua_State * L = static_cast< lua_State * >(s.getLuaState());
+		void * block = lua_touserdata(L, narg);
+		if (block && lua_getmetatable(L, narg)){
+			if (lua_topointer(L, -1) == classMetatable){
+				lua_pop(L, 1);
+				return std::get<1>(**static_cast<LObjectTuple **>(block));		// pointer to T object
+			}
+			// Instances of derived classes carry an upcast to this class in their metatable
+			lua_pushlightuserdata(L, &classKey);
+			lua_rawget(L, -2);
+			const UpcastFunction * upcast = static_cast<const UpcastFunction *>(lua_touserdata(L, -1));
+			lua_pop(L, 2);
+			if (upcast){
+				return static_cast<T>((*upcast)(block));
+			}
+		}
+		s.check_userdata<LObjectTuple *>(narg, className);	// raises the type error
+		return nullptr;
+	}
+
+	// Checks an argument on the stack of the main thread
+	T check(int narg){
+		return check(state, narg);
+	}
+
+/*
+  @ access_property (internal)
+  Arguments:
+    * L - Lua State
+	instance	- Class instance owning the property
+	index	- Property slot, negative for inherited properties
+	set	- Whether to call the setter
+	obj	- Wrapped object
+
+  Description:
+    Calls a property accessor by its slot in the metatable. Derived classes reach properties of
+	their ancestors through it.
+*/
+	static int access_property(lutok::state & s, void * instance, int index, bool set, T obj){
+		C * thisobj = static_cast<C *>(instance);
+		if (index < 0){
+			const InheritedProperty & inherited = thisobj->InheritedPropertyCache[-index - 1];
+			return inherited.access(s, inherited.base, inherited.index, set, obj);
+		}
+		const PropertyPair & fpairs = thisobj->PropertyCache[index];
+		return (thisobj->*(set ? fpairs.second : fpairs.first)) (s, obj);
 	}
 
 /*
@@ -132,37 +442,98 @@ public:
   Arguments:
     * L - Lua State
     * namespac - Namespace to load into
+    * poolSlabSize - Records per slab of the object pool, 0 keeps the current size
 
   Description:
     Registers your class with Lua.  Leave namespac "" if you want to load it into the global space.
 */
 
 	void refresh_methods(int metatable = 0){
-		int i=0, index=0;
+		int i=0;
+		LObject::PropertyCache.clear();
+		LObject::PropertyCache.reserve(properties.size());
 		for (typename PropertyType::const_iterator							// Register some properties in it
 			iter = properties.begin(); iter != properties.end(); iter++) {
 
 			state.push_string((*iter).first);
 			state.push_integer(i);
-			state.set_table(metatable);
-			LObject::PropertyCache[i] = &((*iter).second);
+			state.raw_set(metatable);
+			LObject::PropertyCache.push_back((*iter).second);
 			i++;
 		}
 
 		i=0;
+		LObject::MethodCache.clear();
+		LObject::MethodCache.reserve(methods.size());
 		for (typename FunctionType::const_iterator							// Register some functions in it
 			iter = methods.begin(); iter != methods.end(); iter++) {
-			index = i | ( 1 << 8 );
+			// Every method is bound once to a closure which receives self as
+			// its first argument, so method lookups don't allocate anything.
 			state.push_string((*iter).first);
-			state.push_integer(index);
-			state.set_table(metatable);
-			LObject::MethodCache[i] = (*iter).second;
+			state.push_integer(i);
+			state.push_lightuserdata(static_cast<C*>(this));
+			state.push_cxx_closure(function_dispatch, 2);
+			setMetamethod((*iter).first.c_str(), i, metatable);
+			state.raw_set(metatable);
+			LObject::MethodCache.push_back((*iter).second);
 			i++;
 		}
 	}
 
+/*
+  @ describeMembers
+  Arguments:
+	count	- Receives the number of descriptors
+
+  Description:
+    Returns the compile-time member table of the class, or nullptr when members are added at
+	runtime with LOBJECT_ADD_*. Classes provide their own table by declaring it in the class body:
+
+		LOBJECT_MEMBERS(ExampleObject)
+			LOBJECT_MEMBER_PROPERTY(ExampleObject, "x", getX, setX),
+			LOBJECT_MEMBER_METHOD(ExampleObject, "doSomething", doSomething),
+			LOBJECT_MEMBER_OPERATOR(ExampleObject, add),
+		LOBJECT_MEMBERS_END
+
+	Register() then builds the metatable in a single pass over the array and every method gets
+	its own dispatch stub calling the member directly.
+*/
+	static const Member * describeMembers(size_t & count){
+		count = 0;
+		return nullptr;
+	}
+
+	void register_members(const Member * members, size_t count, int metatable){
+		LObject::PropertyCache.clear();
+		LObject::PropertyCache.reserve(count);
+		LObject::MethodCache.clear();
+		for (size_t i = 0; i < count; i++){
+			const Member & member = members[i];
+			state.push_string(member.name);
+			if (member.kind == MemberProperty){
+				state.push_integer(static_cast<int>(LObject::PropertyCache.size()));
+				LObject::PropertyCache.push_back(PropertyPair(member.first, member.second));
+			}else{
+				state.push_lightuserdata(static_cast<C*>(this));
+				state.push_cxx_closure(member.stub, 1);
+				if (member.kind == MemberOperator){
+					setMetamethod(member.name, static_cast<int>(LObject::MethodCache.size()), metatable);
+					LObject::MethodCache.push_back(member.first);
+				}
+			}
+			state.raw_set(metatable);
+		}
+	}
+
+	// Metatable entries set besides the members: __gc, __tostring, __index and __newindex below,
+	// plus at most one per operator metamethod installed by setMetamethod() (13 of them)
+	static const int fixedMetatableEntries = 4 + 13;
+
     // REGISTER CLASS AS A GLOBAL TABLE 
-    void Register(const std::string & namespac = "", bool create_constructor = false) {
+    void Register(const std::string & namespac = "", bool create_constructor = false, size_t poolSlabSize = 0) {
+		if (poolSlabSize){
+			TuplePool.setSlabSize(poolSlabSize);
+		}
 
 		if (create_constructor){
 			if ( !namespac.empty() ){
@@ -182,67 +553,113 @@ public:
 			}
 		}
 		
-		state.new_metatable(className);
+		size_t memberCount = 0;
+		const Member * members = C::describeMembers(memberCount);
+		if (members){
+			state.new_metatable(className, static_cast<int>(memberCount) + fixedMetatableEntries);
+		}else{
+			state.new_metatable(className);
+		}
 		int             metatable = state.get_top();
+		classMetatable = lua_topointer(static_cast< lua_State * >(state.getLuaState()), metatable);
 		
 		state.push_literal("__gc");
 		state.push_cxx_function(&gc_obj);
-		state.set_table(metatable);
+		state.raw_set(metatable);
 		
 		state.push_literal("__tostring");
 		state.push_cxx_function(&to_string);
-		state.set_table(metatable);
+		state.raw_set(metatable);
 
 		state.push_literal("__index");
 		state.push_cxx_function(&property_getter);
-		state.set_table(metatable);
+		state.raw_set(metatable);
 
 		state.push_literal("__newindex");
 		state.push_cxx_function(&property_setter);
-		state.set_table(metatable);
-
-		state.push_literal("__add");
-		state.push_cxx_function(&operator_add);
-		state.set_table(metatable);
-		state.push_literal("__sub");
-		state.push_cxx_function(&operator_sub);
-		state.set_table(metatable);
-		state.push_literal("__mul");
-		state.push_cxx_function(&operator_mul);
-		state.set_table(metatable);
-		state.push_literal("__div");
-		state.push_cxx_function(&operator_div);
-		state.set_table(metatable);
-		state.push_literal("__mod");
-		state.push_cxx_function(&operator_mod);
-		state.set_table(metatable);
-		state.push_literal("__pow");
-		state.push_cxx_function(&operator_pow);
-		state.set_table(metatable);
-		state.push_literal("__unm");
-		state.push_cxx_function(&operator_unm);
-		state.set_table(metatable);
-		state.push_literal("__concat");
-		state.push_cxx_function(&operator_concat);
-		state.set_table(metatable);
-		state.push_literal("__len");
-		state.push_cxx_function(&operator_len);
-		state.set_table(metatable);
-		state.push_literal("__eq");
-		state.push_cxx_function(&operator_eq);
-		state.set_table(metatable);
-		state.push_literal("__lt");
-		state.push_cxx_function(&operator_lt);
-		state.set_table(metatable);
-		state.push_literal("__le");
-		state.push_cxx_function(&operator_le);
-		state.set_table(metatable);
-		state.push_literal("__call");
-		state.push_cxx_function(&operator_call);
-		state.set_table(metatable);
-
-		refresh_methods(metatable);
+		state.raw_set(metatable);
+
+
+		inherit(metatable, static_cast<Base *>(nullptr));
+		if (members){
+			register_members(members, memberCount, metatable);
+		}else{
+			refresh_methods(metatable);
+		}
+	}
+
+private:
+	void inherit(int, void *){
+	}
+
+	// Copies the members of the base class down into the metatable and registers
+	// the upcasts to every ancestor. Own members registered afterwards override them.
+	template< class B >
+	void inherit(int metatable, B *){
+		static_assert(std::is_base_of< typename B::ValueType, ValueType >::value,
+			"The wrapped type must derive from the type wrapped by the base class");
+		B & base = B::getInstance(state);
+		state.get_metatable(base.className);
+		if (state.is_nil()){
+			state.pop(1);
+			base.Register();
+		}
+		int basetable = state.get_top();
+
+		InheritedPropertyCache.clear();
+		state.push_nil();
+		while (state.raw_next(basetable)){
+			if (state.is_number()){
+				InheritedProperty inherited = { &inherited_access< B >, &base, state.to_integer() };
+				InheritedPropertyCache.push_back(inherited);
+				state.pop(1);
+				state.push_value();
+				state.push_integer(-static_cast<int>(InheritedPropertyCache.size()));
+				state.raw_set(metatable);
+			}else if (state.is_function() && state.is_string(-2) && !isClassMetamethod(state.to_string(-2))){
+				state.push_value(-2);
+				state.insert(-2);
+				state.raw_set(metatable);
+			}else{
+				state.pop(1);
+			}
+		}
+		state.pop(1);
+		registerUpcasts(metatable, static_cast<B *>(nullptr));
+	}
+
+	void registerUpcasts(int, void *){
+	}
+
+	template< class B >
+	void registerUpcasts(int metatable, B *){
+		state.push_lightuserdata(&B::classKey);
+		state.push_lightuserdata(const_cast<UpcastFunction *>(upcastEntry< B >()));
+		state.raw_set(metatable);
+		registerUpcasts(metatable, static_cast<typename B::BaseClass *>(nullptr));
+	}
+
+	template< class B >
+	static const UpcastFunction * upcastEntry(){
+		static const UpcastFunction function = &upcast< B >;
+		return &function;
+	}
+
+	template< class B >
+	static void * upcast(void * block){
+		return static_cast<typename B::ValueType *>(std::get<1>(**static_cast<LObjectTuple **>(block)));
+	}
+
+	template< class B >
+	static int inherited_access(lutok::state & s, void * base, int index, bool set, T obj){
+		return B::access_property(s, base, index, set, static_cast<typename B::ValueType *>(obj));
+	}
+
+	// Metamethods every class installs for itself
+	static bool isClassMetamethod(const std::string & name){
+		return name == "__gc" || name == "__index" || name == "__newindex" || name == "__tostring";
 	}
+public:
 
 
 /*
@@ -260,37 +677,196 @@ public:
 /*
   @ createNew
   Arguments:
-    * L - Lua State
+    * s - Lua State to push onto
 	T*	- Instance to push
 
   Description:
     Loads an instance of the class into the Lua stack, and provides you a pointer so you can modify it.
+	Functions called from Lua pass the state they were given, which is the calling coroutine.
 */
-    void push(T obj, bool managed = true){
-		int top = state.get_top();
-		if (obj){
-			top = state.get_top(); //0
-			LObjectTuple ** a = state.new_userdata<LObjectTuple *>(); // Create userdata
-			top = state.get_top(); //1
+    void push(lutok::state & s, T obj, bool managed = true){
+		if (!obj){
+			return;
+		}
+		if (!identityCacheEnabled){
+			LObjectTuple ** a = s.new_userdata<LObjectTuple *>(); // Create userdata
 			*a = getObjPair(obj, managed);
-		
-			top = state.get_top(); //1
-			state.get_metatable(className);
-			top = state.get_top(); //2
+			setClassMetatable(s);
+			return;
+		}
 
-			const char * tt = state.typeName(-1);
-			if (state.is_nil()){
-				state.pop(1);
-				top = state.get_top(); //1
-				Register();
-				top = state.get_top(); //2
+		pushIdentityCache(s);
+		s.push_lightuserdata(identityKey(obj));
+		s.raw_get(-2);
+		if (s.is_userdata()){
+			// Already alive in Lua, a managed push hands the ownership over to it
+			LObjectTuple ** a = s.to_userdata<LObjectTuple *>();
+			if (managed && !isEmbedded(a)){
+				std::get<2>(**a) = true;
 			}
-		
-			state.set_metatable();
-			top = state.get_top(); //1
+			s.remove(-2);
+			identityCacheHits++;
+			return;
 		}
+		s.pop(1);
+		identityCacheMisses++;
+
+		LObjectTuple ** a = s.new_userdata<LObjectTuple *>(); // Create userdata
+		*a = getObjPair(obj, managed);
+		setClassMetatable(s);
+		s.push_lightuserdata(identityKey(obj));
+		s.push_value(-2);
+		s.raw_set(-4);
+		s.remove(-2);
     }
 
+	// Pushes onto the stack of the main thread, for C++ code outside of calls from Lua
+	void push(T obj, bool managed = true){
+		push(state, obj, managed);
+	}
+
+/*
+  @ enableIdentityCache
+  Arguments:
+	enable	- Whether push() should reuse the userdata of pointers already alive in Lua
+
+  Description:
+    With the cache enabled, pushing the same pointer again yields the very same userdata, so both
+	values are rawequal and no allocation takes place. Entries are weak and disappear as soon as
+	the userdata is collected, before gc_obj runs. Objects not managed by Lua which are deleted
+	on the C++ side while still referenced from Lua should be dropped with forgetIdentity().
+*/
+	void enableIdentityCache(bool enable = true){
+		identityCacheEnabled = enable;
+	}
+
+	void forgetIdentity(T obj){
+		if (!obj){
+			return;
+		}
+		pushIdentityCache(state);
+		state.push_lightuserdata(identityKey(obj));
+		state.push_nil();
+		state.raw_set(-3);
+		state.pop(1);
+	}
+
+	size_t getIdentityCacheHits() const{
+		return identityCacheHits;
+	}
+
+	size_t getIdentityCacheMisses() const{
+		return identityCacheMisses;
+	}
+
+	// Statistics of the records backing pushed objects
+	const LPool< LObjectTuple > & getPool() const{
+		return TuplePool;
+	}
+
+/*
+  @ setDeferredDestruction
+  Arguments:
+	enable	- Whether destructor() of collected managed objects is postponed
+	maxBacklog	- Number of objects the queue may hold
+
+  Description:
+    Keeps expensive destructors out of the garbage collector: collected managed objects are
+	queued and destroyed by drain(), e.g. between requests. Once maxBacklog objects are waiting,
+	every further collection destroys the oldest one synchronously. Disabling the mode drains the
+	queue, and so does closing the Lua state.
+*/
+	void setDeferredDestruction(bool enable, size_t maxBacklog = 1024){
+		assert(maxBacklog > 0);
+		deferredDestruction = enable;
+		deferredLimit = maxBacklog;
+		if (!enable){
+			drain();
+		}
+	}
+
+	// Objects whose destruction was deferred go with the Lua state
+	virtual void releaseInstance(){
+		drain();
+	}
+
+	// Destroys up to count queued objects, oldest first, all of them when count is 0
+	size_t drain(lutok::state & s, size_t count = 0){
+		size_t destroyed = 0;
+		while (!DeferredQueue.empty() && (count == 0 || destroyed < count)){
+			T obj = DeferredQueue.front();
+			DeferredQueue.pop_front();
+			static_cast<C *>(this)->destructor(s, obj);
+			destroyed++;
+		}
+		return destroyed;
+	}
+
+	// Destructors run on the main thread, for C++ code outside of calls from Lua
+	size_t drain(size_t count = 0){
+		return drain(state, count);
+	}
+
+	size_t getDeferredBacklog() const{
+		return DeferredQueue.size();
+	}
+
+	size_t getDeferredPeak() const{
+		return deferredPeak;
+	}
+
+	// Objects destroyed inside the collector because the backlog was full
+	size_t getDeferredForced() const{
+		return deferredForced;
+	}
+
+/*
+  @ emplace
+  Arguments:
+	s	- Lua State to push onto
+	args	- Constructor arguments of the wrapped value
+
+  Description:
+    Constructs a new value directly inside the Lua userdata and pushes it onto the Lua stack.
+	The object header and the value share a single Lua allocation, so there is neither a heap
+	allocated tuple nor a separately allocated value. The value is destroyed in place by the
+	garbage collector; destructor() is not called for it. Functions called from Lua pass the
+	state they were given, so the value lands on the stack of the calling coroutine.
+*/
+	template< typename... Args >
+	ValueType * emplace(lutok::state & s, Args&&... args){
+		static_assert(std::is_pointer<T>::value, "emplace() requires a pointer wrapped type");
+		typedef EmbeddedObject< ValueType > Block;
+		static_assert(std::alignment_of<Block>::value <= std::alignment_of<double>::value,
+			"Lua userdata cannot hold over-aligned values");
+
+		Block * block = s.new_userdata<Block>(); // Create userdata
+		block->prefix.tuple = NULL;
+		try{
+			new (&block->value) ValueType(std::forward<Args>(args)...);
+		}catch(...){
+			s.pop(1);
+			throw;
+		}
+		destroyEmbedded = &destroyEmbeddedValue< ValueType >;
+		block->prefix.tuple = new (&block->prefix.header) LObjectTuple(static_cast<C*>(this), &block->value, false);
+		setClassMetatable(s);
+		if (identityCacheEnabled){
+			pushIdentityCache(s);
+			s.push_lightuserdata(&block->value);
+			s.push_value(-3);
+			s.raw_set(-3);
+			s.pop(1);
+		}
+		return &block->value;
+	}
+
+	// Pushes onto the stack of the main thread, for C++ code outside of calls from Lua
+	template< typename... Args >
+	ValueType * emplace(Args&&... args){
+		return emplace(state, std::forward<Args>(args)...);
+	}
+
 /*
   @ property_getter (internal)
   Arguments:
@@ -307,25 +883,16 @@ public:
 
 			LObjectTuple ** obj = s.to_userdata<LObjectTuple *>(1);
 			C * thisobj = std::get<0>(**obj);
-			s.push_value(3);
-			
-			if( _index & ( 1 << 8 ) ){ // A func
-				s.push_integer(_index ^ ( 1 << 8 )); // Push the right func index
-				s.push_lightuserdata(obj);
-				s.push_cxx_closure(function_dispatch, 2);
-				return 1; // Return a func
-			}
 			
 			s.pop(2);			// Pop metatable and _index
 			s.remove(1);		// Remove userdata
 			s.remove(1);		// Remove [key]
 			
-			const PropertyPair * fpairs = thisobj->PropertyCache[_index];
 			assert(std::get<1>(**obj));
-			return (thisobj->*(fpairs->first)) (s, std::get<1>(**obj));
+			return access_property(s, thisobj, _index, false, std::get<1>(**obj));
 		}
 		
-		return 1;
+		return 1; // A cached method closure or nil
     }
 
 /*
@@ -351,95 +918,98 @@ public:
 				return 0;
 			}
 			
-			if( _index >> 8 ){ // Try to set a func
-				char c[128];
-				sprintf( c , "Trying to set the method [%s] of class [%s]" , s.to_string(2).c_str() , thisobj->className );
-				s.error( c );
-				return 0;
-			}
-			
 			s.pop(2);			// Pop metatable and _index
 			s.remove(1);		// Remove userdata
 			s.remove(1);		// Remove [key]
 
-			const PropertyPair * fpairs = thisobj->PropertyCache[_index];
 			assert(std::get<1>(**obj));
-			return (thisobj->*(fpairs->second)) (s, std::get<1>(**obj));
+			return access_property(s, thisobj, _index, true, std::get<1>(**obj));
+		}
+		
+		if ( s.is_function() ){ // Try to set a func
+			LObjectTuple ** obj = s.to_userdata<LObjectTuple *>(1);
+			C * thisobj = std::get<0>(**obj);
+			char c[128];
+			sprintf( c , "Trying to set the method [%s] of class [%s]" , s.to_string(2).c_str() , thisobj->className.c_str() );
+			s.error( c );
+			return 0;
 		}
 		
 		return 0;
     }
 
 /*
-  @ operator_ (internal)
+  @ function_dispatch (internal)
   Arguments:
     * L - Lua State
 */
-	static int operator_global(lutok::state & s, const char * name){
-		s.get_metatable(1);
-		s.push_string(name);
-		s.raw_get();
-		if (s.is_number()) {
-			int _index = s.to_integer();
-			LObjectTuple ** obj = s.to_userdata<LObjectTuple *>(1);
-			C * thisobj = std::get<0>(**obj);
-			if( !obj || !*obj ){
-				s.error("Internal error, no object given!");
-				return 0;
-			}
-			if( _index >> 8 ){
-				s.pop(2);
-				Method method = thisobj->MethodCache[_index ^ ( 1 << 8 )];
-				if (method){
-					assert(std::get<1>(**obj));
-					return (thisobj->*(method)) (s, std::get<1>(**obj));
-				}else{
-					char c[128];
-					sprintf( c , "Trying to use unset operator [%s] of class [%s]" , name, thisobj->className );
-					s.error( c );
-					return 0;
-				}
-			}else{
-				char c[128];
-				sprintf( c , "Trying to use unset operator [%s] of class [%s]" , name, thisobj->className );
-				s.error( c );
-				return 0;
-			}
-		}
-		return 0;
+    static int function_dispatch(lutok::state & s) {
+		int i = s.to_integer(s.upvalue_index(1));
+		C * thisobj = static_cast<C *>(const_cast<void *>(s.to_lightuserdata(s.upvalue_index(2))));
+		T obj = thisobj->check(s, 1);	// self
+		assert(obj);
+		return (thisobj->*(thisobj->MethodCache[i])) (s, obj);
+    }
+
+/*
+  @ field_getter, field_setter (internal)
+  Arguments:
+    * L - Lua State
+	obj	- Wrapped object
+
+  Description:
+    Property accessors generated for a data member of the wrapped type, see LOBJECT_ADD_FIELD and
+	LOBJECT_MEMBER_FIELD. The conversions live in LField, as LHandle binds fields the same way. The
+	setter finds the new value at index 1, as property_setter leaves it there.
+*/
+	template< typename F, F Field >
+	int field_getter(lutok::state & s, T obj){
+		return LField< F, Field >::get(s, obj);
 	}
 
-	#define LUTOK_OPERATOR_CALLER_DEFINITION(OPERATORNAME) \
-	static int OPERATORNAME(lutok::state & s){\
-		return operator_global(s, # OPERATORNAME);\
+	template< typename F, F Field >
+	int field_setter(lutok::state & s, T obj){
+		return LField< F, Field >::set(s, obj, className);
 	}
 
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_add)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_sub)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_mul)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_div)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_mod)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_pow)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_unm)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_concat)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_len)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_eq)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_lt)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_le)
-	LUTOK_OPERATOR_CALLER_DEFINITION(operator_call)
+/*
+  @ operator_dispatch (internal)
+  Arguments:
+    * L - Lua State
+
+  Description:
+    Metamethod bound to a MethodCache slot. Self is recognized by comparing its metatable with the
+	class metatable kept as upvalue, which avoids the registry lookup of check().
+*/
+	static int operator_dispatch(lutok::state & s) {
+		lua_State * L = static_cast< lua_State * >(s.getLuaState());
+		C * thisobj = static_cast<C *>(const_cast<void *>(s.to_lightuserdata(s.upvalue_index(2))));
+		bool self = false;
+		if (lua_getmetatable(L, 1)){
+			self = lua_rawequal(L, -1, lua_upvalueindex(3)) != 0;
+			lua_pop(L, 1);
+		}
+		// Anything else is an instance of a derived class or a type error
+		T obj = self ? std::get<1>(**static_cast<LObjectTuple **>(lua_touserdata(L, 1))) : thisobj->check(s, 1);
+		assert(obj);
+		return (thisobj->*(thisobj->MethodCache[s.to_integer(s.upvalue_index(1))])) (s, obj);
+	}
 
 /*
-  @ function_dispatch (internal)
+  @ method_stub (internal)
   Arguments:
     * L - Lua State
+
+  Description:
+    Per-member dispatch stub used by compile-time member descriptors.
 */
-    static int function_dispatch(lutok::state & s) {
-		int i = s.to_integer(s.upvalue_index(1));
-		LObjectTuple ** obj = s.to_userdata<LObjectTuple *>(s.upvalue_index(2));
-		C * thisobj = std::get<0>(**obj);
-		assert(std::get<1>(**obj));
-		return (thisobj->*(thisobj->MethodCache[i])) (s, std::get<1>(**obj));
-    }
+	template< Method M >
+	static int method_stub(lutok::state & s) {
+		C * thisobj = static_cast<C *>(const_cast<void *>(s.to_lightuserdata(s.upvalue_index(1))));
+		T obj = thisobj->check(s, 1);	// self
+		assert(obj);
+		return (thisobj->*M) (s, obj);
+	}
 
 /*
   @ gc_obj (internal)
@@ -451,12 +1021,23 @@ public:
 		
 		if( obj && *obj){
 			C * thisobj = std::get<0>(**obj);
+			if ( isEmbedded(obj) ){
+				//stored in place
+				thisobj->destroyEmbedded(obj);
+				(*obj)->~LObjectTuple();
+				*obj = NULL;
+				return 0;
+			}
 			//managed
 			if ( std::get<2>(**obj) ){
 				assert(std::get<1>(**obj));
-				thisobj->destructor(s, std::get<1>(**obj));
+				if (thisobj->deferredDestruction){
+					thisobj->defer(s, std::get<1>(**obj));
+				}else{
+					thisobj->destructor(s, std::get<1>(**obj));
+				}
 			}
-			delete(*obj);
+			thisobj->TuplePool.release(*obj);
 		}
 		return 0;
     }
@@ -489,17 +1070,49 @@ template <class C> C & LSingleton::getInstance(lutok::state & state){
 }
 */
 
-template <class C> std::unique_ptr<C> LSingleton<C>::m_instance;
-template <class C> std::once_flag LSingleton<C>::m_onceFlag;
+template <class C> char LSingleton<C>::m_registryKey;
+
+template <class C, typename T, class Base> char LObject<C, T, Base>::classKey;
+
+template <class C> int LSingleton<C>::collectInstance(lutok::state & s){
+	C ** instance = s.to_userdata<C *>(1);
+	if (*instance){
+		static_cast<LSingleton<C> *>(*instance)->releaseInstance();
+	}
+	delete *instance;
+	*instance = NULL;
+	return 0;
+}
 
 template <class C> C & LSingleton<C>::getInstance(lutok::state & state){
 	assert((std::is_base_of<LSingleton<C>, C>::value == true));
 
-	std::call_once(m_onceFlag,
-		[& state] {
-			m_instance.reset(new C(state));
-	});
-	return *m_instance.get();
+	state.push_lightuserdata(&m_registryKey);
+	state.raw_get(lutok::registry_index);
+	C ** instance = state.to_userdata<C *>();
+	if (!instance){
+		// First use within this Lua state, registration only touches the state itself
+		state.pop(1);
+		instance = state.new_userdata<C *>();
+		*instance = NULL;
+		state.new_table();
+		state.push_cxx_function(&collectInstance);
+		state.raw_set_field(-2, "__gc");
+		state.set_metatable();
+
+		state.push_lightuserdata(&m_registryKey);
+		state.push_value(-2);
+		state.raw_set(lutok::registry_index);
+		try{
+			*instance = new C(state);
+		}catch(...){
+			state.pop(1);
+			throw;
+		}
+	}
+	C & result = **instance;
+	state.pop(1);
+	return result;
 }
 
 }
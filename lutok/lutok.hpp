@@ -3,5 +3,12 @@
 #include <lutok/state.ipp>
 #include <lutok/buffer.hpp>
 #include <lutok/lobject.hpp>
+#include <lutok/lhandle.hpp>
+#include <lutok/lcomponent.hpp>
+#include <lutok/larray.hpp>
 #include <lutok/stack_cleaner.hpp>
-#include <lutok/debug.hpp>
\ No newline at end of file
+#include <lutok/string_ref.hpp>
+#include <lutok/key.hpp>
+#include <lutok/debug.hpp>
+#include <lutok/bind.hpp>
+#include <lutok/marshal.hpp>
\ No newline at end of file
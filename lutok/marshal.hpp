@@ -0,0 +1,262 @@
+/// \file marshal.hpp
+/// Conversion of C++ maps and structs to and from Lua tables.
+///
+/// Every function in this file builds its table with the final size already
+/// known, through lua_createtable, so the table is never rehashed while its
+/// fields are added.  Keys and values are converted with the same rules as the
+/// arguments of bound functions (see bind.hpp).
+///
+/// Structs are described once by a static array of fields:
+///
+/// struct point { double x; double y; std::string label; };
+///
+/// static const lutok::record_field< point > point_fields[] = {
+///     LUTOK_RECORD_FIELD(point, x),
+///     LUTOK_RECORD_FIELD(point, y),
+///     LUTOK_RECORD_FIELD(point, label),
+/// };
+/// ...
+/// lutok::push_record(state, value, point_fields);
+/// lutok::get_record(state, -1, value, point_fields);
+
+#if !defined(LUTOK_MARSHAL_HPP)
+#define LUTOK_MARSHAL_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include <lua.hpp>
+
+#include <lutok/bind.hpp>
+#include <lutok/c_gate.hpp>
+#include <lutok/exceptions.hpp>
+#include <lutok/state.hpp>
+
+/// Describes the data member FIELD of STRUCT, exposed under its own name.
+#define LUTOK_RECORD_FIELD(STRUCT, FIELD) \
+    { #FIELD, sizeof(#FIELD) - 1, \
+      &lutok::detail::record_member< STRUCT, decltype(STRUCT::FIELD), \
+                                     &STRUCT::FIELD >::push, \
+      &lutok::detail::record_member< STRUCT, decltype(STRUCT::FIELD), \
+                                     &STRUCT::FIELD >::get }
+
+namespace lutok {
+
+
+/// Description of a data member of a struct marshalled to a table.
+///
+/// Instances are meant to be built with LUTOK_RECORD_FIELD, which generates
+/// the conversion functions for the concrete member.
+template< typename Struct >
+struct record_field {
+    /// Key of the member in the table.
+    const char* name;
+
+    /// Length of the name, compared before its characters.
+    std::size_t length;
+
+    /// Pushes the member of the given struct.
+    void (*push)(lua_State*, const Struct&);
+
+    /// Stores the value at the given stack index into the member.
+    void (*get)(lua_State*, const int, Struct&);
+};
+
+
+namespace detail {
+
+
+/// Conversion functions of the data member Member of Struct.
+template< typename Struct, typename Type, Type Struct::* Member >
+struct record_member {
+    static void
+    push(lua_State* raw_state, const Struct& value)
+    {
+        stack_value< Type >::push(raw_state, value.*Member);
+    }
+
+    static void
+    get(lua_State* raw_state, const int index, Struct& value)
+    {
+        value.*Member = stack_value< Type >::get(raw_state, index);
+    }
+};
+
+
+/// Raises the error for a table value of an unexpected type.
+///
+/// \pre stack(-2) and stack(-1) are the key and the offending value, which
+/// are popped before throwing.
+///
+/// \param raw_state The Lua C API state.
+/// \param what Description of the table entry.
+inline void
+table_entry_error(lua_State* raw_state, const std::string& what)
+{
+    const std::string message = "Invalid " + what + " of type " +
+        luaL_typename(raw_state, -1) + " in table";
+    lua_pop(raw_state, 2);
+    throw lutok::error(message);
+}
+
+
+/// Converts a stack index into one that is not affected by pushes.
+inline int
+absolute_index(lua_State* raw_state, const int index)
+{
+    return (index < 0 && index > LUA_REGISTRYINDEX) ?
+        lua_gettop(raw_state) + index + 1 : index;
+}
+
+
+}  // namespace detail
+
+
+/// Pushes a new table holding the entries of a map.
+///
+/// Works with std::map, std::unordered_map and any other container of pairs
+/// exposing key_type and mapped_type.
+///
+/// \param s The Lua state.
+/// \param values The entries to store in the table.
+///
+/// \warning Terminates execution if there is not enough memory.
+template< typename Map >
+void
+push_map(state& s, const Map& values)
+{
+    typedef typename Map::key_type key_type;
+    typedef typename Map::mapped_type mapped_type;
+    lua_State* raw_state = state_c_gate(s).c_state();
+
+    lua_createtable(raw_state, 0, static_cast< int >(values.size()));
+    for (typename Map::const_iterator iter = values.begin();
+         iter != values.end(); ++iter) {
+        detail::stack_value< key_type >::push(raw_state, (*iter).first);
+        detail::stack_value< mapped_type >::push(raw_state, (*iter).second);
+        lua_rawset(raw_state, -3);
+    }
+}
+
+
+/// Adds the entries of a table to a map.
+///
+/// The table is traversed once, with raw accesses.  Entries already in the
+/// map are overwritten by those of the table.
+///
+/// \param s The Lua state.
+/// \param index The stack index of the table.
+/// \param [out] values The map to fill.
+///
+/// \throw error If the value at index is not a table, or if one of its keys
+///     or values cannot be converted.
+template< typename Map >
+void
+get_map(state& s, const int index, Map& values)
+{
+    typedef typename Map::key_type key_type;
+    typedef typename Map::mapped_type mapped_type;
+    lua_State* raw_state = state_c_gate(s).c_state();
+
+    if (!lua_istable(raw_state, index))
+        throw lutok::error("get_map: table expected");
+    const int table = detail::absolute_index(raw_state, index);
+
+    lua_pushnil(raw_state);
+    while (lua_next(raw_state, table) != 0) {
+        // Convert a copy of the key: converting a number key to a string in
+        // place would confuse lua_next.
+        lua_pushvalue(raw_state, -2);
+        key_type key;
+        try {
+            key = detail::stack_value< key_type >::get(raw_state, -1);
+        } catch (const lutok::error&) {
+            lua_replace(raw_state, -2);
+            detail::table_entry_error(raw_state, "key");
+        }
+        lua_pop(raw_state, 1);
+        try {
+            values[key] = detail::stack_value< mapped_type >::get(raw_state,
+                                                                  -1);
+        } catch (const lutok::error&) {
+            detail::table_entry_error(raw_state, "value");
+        }
+        lua_pop(raw_state, 1);
+    }
+}
+
+
+/// Pushes a new table holding the described members of a struct.
+///
+/// \param s The Lua state.
+/// \param value The struct to convert.
+/// \param fields The members to store, see LUTOK_RECORD_FIELD.
+///
+/// \warning Terminates execution if there is not enough memory.
+template< typename Struct, std::size_t Count >
+void
+push_record(state& s, const Struct& value,
+            const record_field< Struct > (&fields)[Count])
+{
+    lua_State* raw_state = state_c_gate(s).c_state();
+
+    lua_createtable(raw_state, 0, static_cast< int >(Count));
+    for (std::size_t i = 0; i < Count; i++) {
+        lua_pushlstring(raw_state, fields[i].name, fields[i].length);
+        fields[i].push(raw_state, value);
+        lua_rawset(raw_state, -3);
+    }
+}
+
+
+/// Stores the fields of a table into the described members of a struct.
+///
+/// The table is traversed once, with raw accesses, instead of being queried
+/// once per member.  Members missing from the table keep their value and
+/// entries of the table that are not described are ignored.
+///
+/// \param s The Lua state.
+/// \param index The stack index of the table.
+/// \param [out] value The struct to fill.
+/// \param fields The members to read, see LUTOK_RECORD_FIELD.
+///
+/// \throw error If the value at index is not a table or if the value of a
+///     member has the wrong type.
+template< typename Struct, std::size_t Count >
+void
+get_record(state& s, const int index, Struct& value,
+           const record_field< Struct > (&fields)[Count])
+{
+    lua_State* raw_state = state_c_gate(s).c_state();
+
+    if (!lua_istable(raw_state, index))
+        throw lutok::error("get_record: table expected");
+    const int table = detail::absolute_index(raw_state, index);
+
+    lua_pushnil(raw_state);
+    while (lua_next(raw_state, table) != 0) {
+        if (lua_type(raw_state, -2) == LUA_TSTRING) {
+            std::size_t length;
+            const char* key = lua_tolstring(raw_state, -2, &length);
+            for (std::size_t i = 0; i < Count; i++) {
+                if (length != fields[i].length ||
+                    std::memcmp(key, fields[i].name, length) != 0)
+                    continue;
+                try {
+                    fields[i].get(raw_state, -1, value);
+                } catch (const lutok::error&) {
+                    detail::table_entry_error(raw_state, std::string(
+                        "value of field ") + fields[i].name);
+                }
+                break;
+            }
+        }
+        lua_pop(raw_state, 1);
+    }
+}
+
+
+}  // namespace lutok
+
+#endif  // !defined(LUTOK_MARSHAL_HPP)
@@ -57,6 +57,30 @@ lutok::create_module(state& s, const std::string& name,
 }
 
 
+/// Creates a module out of plain C functions.
+///
+/// Unlike the cxx_function version, the functions are pushed as they are, so
+/// no userdata is allocated per member.
+///
+/// \param s The Lua state.
+/// \param name The name of the module to create.
+/// \param members The list of member functions to add to the module.
+void
+lutok::create_module(state& s, const std::string& name,
+                     const std::map< std::string, c_function >& members)
+{
+    stack_cleaner cleaner(s);
+    s.new_table();
+    for (std::map< std::string, c_function >::const_iterator
+         iter = members.begin(); iter != members.end(); iter++) {
+        s.push_string((*iter).first);
+        s.push_c_function((*iter).second);
+        s.set_table(-3);
+    }
+    s.set_global(name);
+}
+
+
 /// Loads and processes a Lua file.
 ///
 /// This is a replacement for luaL_dofile but with proper error reporting
@@ -173,4 +197,36 @@ void lutok::registerLib(state& s, const std::string& name, const std::map< std::
         s.set_table(-3);
     }
 	s.pop(nup);
-}
\ No newline at end of file
+}
+
+/// Opens a library made of plain C functions
+///
+/// \param s The Lua state.
+/// \param members The list of member functions to add to the module.
+void lutok::registerLib(state& s, const std::map< std::string, c_function >& members){
+	assert(s.is_table());
+
+    for (std::map< std::string, c_function >::const_iterator
+         iter = members.begin(); iter != members.end(); iter++) {
+        s.push_string((*iter).first);
+        s.push_c_function((*iter).second);
+        s.set_table(-3);
+    }
+}
+
+/// Opens a library made of plain C functions
+///
+/// \param s The Lua state.
+/// \param name The name of the module to create.
+/// \param members The list of member functions to add to the module.
+void lutok::registerLib(state& s, const std::string& name, const std::map< std::string, c_function >& members, const int nup){
+	s.findLib(name, members.size(), nup);
+	assert(s.is_table());
+    for (std::map< std::string, c_function >::const_iterator
+         iter = members.begin(); iter != members.end(); iter++) {
+        s.push_string((*iter).first);
+        s.push_c_function((*iter).second);
+        s.set_table(-3);
+    }
+	s.pop(nup);
+}
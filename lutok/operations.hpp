@@ -43,12 +43,16 @@ namespace lutok {
 
 void create_module(state&, const std::string&,
                    const std::map< std::string, cxx_function >&);
+void create_module(state&, const std::string&,
+                   const std::map< std::string, c_function >&);
 unsigned int do_file(state&, const std::string&, const int = 0);
 unsigned int do_string(state&, const std::string&, const int = 0);
 void eval(state&, const std::string&, const int = 1);
 
 void registerLib(state&, const std::map< std::string, cxx_function >&);
 void registerLib(state&, const std::string&, const std::map< std::string, cxx_function >&, const int nup = 0);
+void registerLib(state&, const std::map< std::string, c_function >&);
+void registerLib(state&, const std::string&, const std::map< std::string, c_function >&, const int nup = 0);
 
 
 }  // namespace lutok
@@ -38,6 +38,8 @@
 
 #include <cassert>
 #include <cstring>
+#include <exception>
+#include <type_traits>
 
 #include "c_gate.hpp"
 #include "exceptions.hpp"
@@ -47,6 +49,10 @@
 namespace {
 
 
+/// Registry key under which the main thread of a Lua session is recorded.
+static char main_thread_key;
+
+
 /// Wrapper around lua_getglobal to run in a protected environment.
 ///
 /// \pre stack(-1) is the name of the global to get.
@@ -171,7 +177,6 @@ static int
 	char error_buf[1024];
 
 	try {
-		lutok::state state = lutok::state_c_gate::connect(raw_state);
 		return function(arg);
 	} catch (const std::exception& e) {
 		std::strncpy(error_buf, e.what(), sizeof(error_buf));
@@ -196,14 +201,16 @@ static int
 /// C++ function we have to call.  All we do here is safely delegate the
 /// execution to the wrapped C++ closure.
 ///
+/// This generic version has to query the debug interface to find out where the
+/// extra upvalue lives, so it is only used for closures with more upvalues
+/// than the ones covered by cxx_closure_trampolines.
+///
 /// \param raw_state The Lua C API state.
 ///
 /// \return The number of return values of the called closure.
 static int
 cxx_closure_trampoline(lua_State* raw_state)
 {
-    lutok::state state = lutok::state_c_gate::connect(raw_state);
-
     int nupvalues;
     {
         lua_Debug debug;
@@ -212,12 +219,55 @@ cxx_closure_trampoline(lua_State* raw_state)
         nupvalues = debug.nups;
     }
 
-    lutok::cxx_function* function = state.to_userdata< lutok::cxx_function >(
-        state.upvalue_index(nupvalues));
+    lutok::cxx_function* function = static_cast< lutok::cxx_function* >(
+        lua_touserdata(raw_state, lua_upvalueindex(nupvalues)));
+    return call_cxx_function_from_c(*function, raw_state);
+}
+
+
+/// Lua glue to call a C++ closure with a known number of upvalues.
+///
+/// Same as cxx_closure_trampoline, but the position of the upvalue holding the
+/// C++ function is fixed at compile time, so locating it is a constant-time
+/// operation.
+///
+/// \tparam NValues The number of user-provided upvalues of the closure.
+///
+/// \param raw_state The Lua C API state.
+///
+/// \return The number of return values of the called closure.
+template< int NValues >
+static int
+cxx_closure_trampoline_n(lua_State* raw_state)
+{
+    lutok::cxx_function* function = static_cast< lutok::cxx_function* >(
+        lua_touserdata(raw_state, lua_upvalueindex(NValues + 1)));
+    assert(function);
     return call_cxx_function_from_c(*function, raw_state);
 }
 
 
+/// Trampolines for closures with few upvalues, indexed by the upvalue count.
+static const lua_CFunction cxx_closure_trampolines[] = {
+    cxx_closure_trampoline_n< 0 >,
+    cxx_closure_trampoline_n< 1 >,
+    cxx_closure_trampoline_n< 2 >,
+    cxx_closure_trampoline_n< 3 >,
+    cxx_closure_trampoline_n< 4 >,
+    cxx_closure_trampoline_n< 5 >,
+    cxx_closure_trampoline_n< 6 >,
+    cxx_closure_trampoline_n< 7 >,
+    cxx_closure_trampoline_n< 8 >,
+    cxx_closure_trampoline_n< 9 >,
+    cxx_closure_trampoline_n< 10 >,
+    cxx_closure_trampoline_n< 11 >,
+    cxx_closure_trampoline_n< 12 >,
+    cxx_closure_trampoline_n< 13 >,
+    cxx_closure_trampoline_n< 14 >,
+    cxx_closure_trampoline_n< 15 >,
+};
+
+
 /// Lua glue to call a C++ function.
 ///
 /// This Lua binding is actually a closure that we have constructed from the
@@ -231,29 +281,80 @@ cxx_closure_trampoline(lua_State* raw_state)
 static int
 	cxx_function_trampoline(lua_State* raw_state)
 {
-	lutok::state state = lutok::state_c_gate::connect(raw_state);
-	lutok::cxx_function* function = state.to_userdata< lutok::cxx_function >(
-		state.upvalue_index(1));
+	lutok::cxx_function* function = static_cast< lutok::cxx_function* >(
+		lua_touserdata(raw_state, lua_upvalueindex(1)));
 	assert(function);
 	return call_cxx_function_from_c(*function, raw_state);
 }
 
 
-}  // anonymous namespace
-
+/// Lua glue to call a C++ function through lua_cpcall.
+///
+/// lua_cpcall passes its user pointer as the only argument of the called
+/// function.  The pointer refers to a cxx_function_ex_holder that lives on the
+/// C++ stack of state::cpcall(), so no Lua memory is allocated per call.
+///
+/// \param raw_state The Lua C API state.
+///
+/// \return The number of return values of the called function.
 static int
 	cxx_function_trampoline_ex(lua_State* raw_state)
 {
-	lutok::state state = lutok::state_c_gate::connect(raw_state);
-	lutok::cxx_function_ex_holder * holder = state.to_userdata< lutok::cxx_function_ex_holder >(
-		state.upvalue_index(1));
-	lutok::cxx_function_ex function = holder->function;
-	void * arg = holder->arg;
-	return call_cxx_function_from_c_ex(function, raw_state, arg);
+	lutok::cxx_function_ex_holder * holder =
+		static_cast< lutok::cxx_function_ex_holder* >(lua_touserdata(raw_state, 1));
+	assert(holder);
+	return call_cxx_function_from_c_ex(holder->function, raw_state, holder->arg);
 }
 
 
+/// Description of a region run by state::protect().
+struct protected_region {
+    /// The function that invokes the user callable.
+    void (*function)(lutok::state&, void*);
+
+    /// The user callable.
+    void* callable;
+
+    /// The state object handed to the callable.
+    lutok::state* region_state;
+
+    /// The C++ exception that aborted the region, if any.
+    std::exception_ptr exception;
+};
+
+
+/// Lua glue to run a protected region.
+///
+/// \pre stack(1) is a light userdata pointing to the protected_region.
+///
+/// \param raw_state The Lua C API state.
+///
+/// \return All the values left on the stack by the region.
+static int
+protected_region_trampoline(lua_State* raw_state)
+{
+    protected_region* region = static_cast< protected_region* >(
+        lua_touserdata(raw_state, 1));
+    lua_remove(raw_state, 1);
+
+    try {
+        region->function(*region->region_state, region->callable);
+        return lua_gettop(raw_state);
+    } catch (...) {
+        region->exception = std::current_exception();
+    }
+    // The exception is kept aside and rethrown by state::protect() once we
+    // are back outside of the Lua call; here we only need to abort the call,
+    // which we do from outside of the try/catch context.
+    return luaL_error(raw_state, "Unhandled exception in protected region");
+}
+
+
+}  // anonymous namespace
+
+
 const int lutok::globals_index = LUA_GLOBALSINDEX;
+const int lutok::registry_index = LUA_REGISTRYINDEX;
 
 
 /// Internal implementation for lutok::state.
@@ -280,9 +381,11 @@ struct lutok::state::impl {
 ///
 /// You must share the same state object alongside the lifetime of your Lua
 /// session.  As soon as the object is destroyed, the session is terminated.
-lutok::state::state(void)
+lutok::state::state(void) :
+    _pimpl(new impl(NULL, true)),
+    _lua_state(NULL),
+    _protected_region(false)
 {
-    _pimpl.reset(new impl(NULL, true));
 }
 
 /// Initializes the Lua state.
@@ -295,6 +398,8 @@ void lutok::state::new_state(void)
 	if (lua == NULL)
 		throw lutok::error("lua open failed");
 	_pimpl.reset(new impl(lua, true));
+	_lua_state = lua;
+	getMainLuaState();	// records the main thread
 }
 
 
@@ -303,9 +408,13 @@ void lutok::state::new_state(void)
 /// Instances constructed using this method do NOT own the raw state.  This
 /// means that, on exit, the state will not be destroyed.
 ///
+/// Borrowed states do not allocate any memory, so it is cheap to construct
+/// them on the fly for every call into C++ code.
+///
 /// \param raw_state_ The raw Lua state to wrap.
 lutok::state::state(void* raw_state_) :
-    _pimpl(new impl(reinterpret_cast< lua_State* >(raw_state_), false))
+    _lua_state(reinterpret_cast< lua_State* >(raw_state_)),
+    _protected_region(false)
 {
 }
 
@@ -317,14 +426,15 @@ lutok::state::state(void* raw_state_) :
 /// code.
 lutok::state::~state(void)
 {
-    if (_pimpl->owned && _pimpl->lua_state != NULL)
+    if (_pimpl && _pimpl->owned && _pimpl->lua_state != NULL)
         close();
 }
 
 
 lutok::state & lutok::state::operator= (lutok::state & arg) {
-	//_pimpl = new impl(reinterpret_cast< lua_State* >(arg._pimpl.), false);
 	_pimpl = arg._pimpl;
+	_lua_state = arg._lua_state;
+	_protected_region = arg._protected_region;
 	return *this;
 }
 
@@ -339,10 +449,12 @@ lutok::state & lutok::state::operator= (lutok::state & arg) {
 void
 lutok::state::close(void)
 {
-    assert(_pimpl->lua_state != NULL);
-    assert(lua_gettop(_pimpl->lua_state) == 0);
-    lua_close(_pimpl->lua_state);
-    _pimpl->lua_state = NULL;
+    assert(_lua_state != NULL);
+    assert(lua_gettop(_lua_state) == 0);
+    lua_close(_lua_state);
+    if (_pimpl)
+        _pimpl->lua_state = NULL;
+    _lua_state = NULL;
 }
 
 
@@ -357,9 +469,13 @@ lutok::state::close(void)
 void
 lutok::state::get_global(const std::string& name)
 {
-    lua_pushcfunction(_pimpl->lua_state, protected_getglobal);
-    lua_pushstring(_pimpl->lua_state, name.c_str());
-    if (lua_pcall(_pimpl->lua_state, 1, 1, 0) != 0)
+    if (_protected_region) {
+        lua_getglobal(_lua_state, name.c_str());
+        return;
+    }
+    lua_pushcfunction(_lua_state, protected_getglobal);
+    lua_pushstring(_lua_state, name.c_str());
+    if (lua_pcall(_lua_state, 1, 1, 0) != 0)
         throw lutok::api_error::from_stack(*this, "lua_getglobal");
 }
 
@@ -376,7 +492,7 @@ lutok::state::get_global(const std::string& name)
 bool
 lutok::state::get_metafield(const int index, const std::string& name)
 {
-    return luaL_getmetafield(_pimpl->lua_state, index, name.c_str()) != 0;
+    return luaL_getmetafield(_lua_state, index, name.c_str()) != 0;
 }
 
 
@@ -388,7 +504,7 @@ lutok::state::get_metafield(const int index, const std::string& name)
 bool
 lutok::state::get_metatable(const int index)
 {
-    return lua_getmetatable(_pimpl->lua_state, index) != 0;
+    return lua_getmetatable(_lua_state, index) != 0;
 }
 
 
@@ -403,13 +519,17 @@ lutok::state::get_metatable(const int index)
 void
 lutok::state::get_table(const int index)
 {
-    assert(lua_gettop(_pimpl->lua_state) >= 2);
-    lua_pushcfunction(_pimpl->lua_state, protected_gettable);
-    lua_pushvalue(_pimpl->lua_state, index < 0 ? index - 1 : index);
-    lua_pushvalue(_pimpl->lua_state, -3);
-    if (lua_pcall(_pimpl->lua_state, 2, 1, 0) != 0)
+    assert(lua_gettop(_lua_state) >= 2);
+    if (_protected_region) {
+        lua_gettable(_lua_state, index);
+        return;
+    }
+    lua_pushcfunction(_lua_state, protected_gettable);
+    lua_pushvalue(_lua_state, index < 0 ? index - 1 : index);
+    lua_pushvalue(_lua_state, -3);
+    if (lua_pcall(_lua_state, 2, 1, 0) != 0)
         throw lutok::api_error::from_stack(*this, "lua_gettable");
-    lua_remove(_pimpl->lua_state, -2);
+    lua_remove(_lua_state, -2);
 }
 
 
@@ -419,7 +539,7 @@ lutok::state::get_table(const int index)
 int
 lutok::state::get_top(void)
 {
-    return lua_gettop(_pimpl->lua_state);
+    return lua_gettop(_lua_state);
 }
 
 
@@ -429,7 +549,7 @@ lutok::state::get_top(void)
 void
 lutok::state::insert(const int index)
 {
-    lua_insert(_pimpl->lua_state, index);
+    lua_insert(_lua_state, index);
 }
 
 
@@ -441,7 +561,7 @@ lutok::state::insert(const int index)
 bool
 lutok::state::is_boolean(const int index)
 {
-    return lua_isboolean(_pimpl->lua_state, index);
+    return lua_isboolean(_lua_state, index);
 }
 
 
@@ -453,7 +573,7 @@ lutok::state::is_boolean(const int index)
 bool
 lutok::state::is_function(const int index)
 {
-    return lua_isfunction(_pimpl->lua_state, index);
+    return lua_isfunction(_lua_state, index);
 }
 
 
@@ -465,7 +585,7 @@ lutok::state::is_function(const int index)
 bool
 lutok::state::is_nil(const int index)
 {
-    return lua_isnil(_pimpl->lua_state, index);
+    return lua_isnil(_lua_state, index);
 }
 
 
@@ -477,7 +597,7 @@ lutok::state::is_nil(const int index)
 bool
 lutok::state::is_number(const int index)
 {
-    return (lua_isnumber(_pimpl->lua_state, index)==1);
+    return (lua_isnumber(_lua_state, index)==1);
 }
 
 /// Wrapper around lua_isstring.
@@ -488,7 +608,7 @@ lutok::state::is_number(const int index)
 bool
 lutok::state::is_string(const int index)
 {
-    return (lua_isstring(_pimpl->lua_state, index)==1);
+    return (lua_isstring(_lua_state, index)==1);
 }
 
 
@@ -500,7 +620,7 @@ lutok::state::is_string(const int index)
 bool
 lutok::state::is_table(const int index)
 {
-    return (lua_istable(_pimpl->lua_state, index)==1);
+    return (lua_istable(_lua_state, index)==1);
 }
 
 
@@ -512,7 +632,7 @@ lutok::state::is_table(const int index)
 bool
 lutok::state::is_userdata(const int index)
 {
-    return (lua_isuserdata(_pimpl->lua_state, index)==1);
+    return (lua_isuserdata(_lua_state, index)==1);
 }
 
 
@@ -529,7 +649,7 @@ lutok::state::load_file(const std::string& file)
 {
     if (!::ACCESS_FN(file.c_str(), 4) == 0)
         throw lutok::file_not_found_error(file);
-    if (luaL_loadfile(_pimpl->lua_state, file.c_str()) != 0)
+    if (luaL_loadfile(_lua_state, file.c_str()) != 0)
         throw lutok::api_error::from_stack(*this, "luaL_loadfile");
 }
 
@@ -544,7 +664,7 @@ lutok::state::load_file(const std::string& file)
 void
 lutok::state::load_string(const std::string& str)
 {
-    if (luaL_loadstring(_pimpl->lua_state, str.c_str()) != 0)
+    if (luaL_loadstring(_lua_state, str.c_str()) != 0)
         throw lutok::api_error::from_stack(*this, "luaL_loadstring");
 }
 
@@ -555,12 +675,27 @@ lutok::state::load_string(const std::string& str)
 void
 lutok::state::new_table(void)
 {
-    lua_newtable(_pimpl->lua_state);
+    lua_newtable(_lua_state);
+}
+
+
+/// Wrapper around lua_createtable.
+///
+/// Preallocating the table avoids rehashing it while it is being filled.
+///
+/// \param narr The number of elements the array part has room for.
+/// \param nrec The number of other fields the hash part has room for.
+///
+/// \warning Terminates execution if there is not enough memory.
+void
+lutok::state::new_table(const int narr, const int nrec)
+{
+    lua_createtable(_lua_state, narr, nrec);
 }
 
 
 void * lutok::state::new_thread(void){
-	return lua_newthread(_pimpl->lua_state);
+	return lua_newthread(_lua_state);
 }
 
 /// Wrapper around lua_newuserdata.
@@ -576,7 +711,7 @@ void * lutok::state::new_thread(void){
 void*
 lutok::state::new_userdata_voidp(const size_t size)
 {
-    return lua_newuserdata(_pimpl->lua_state, size);
+    return lua_newuserdata(_lua_state, size);
 }
 
 
@@ -590,19 +725,21 @@ lutok::state::new_userdata_voidp(const size_t size)
 bool
 lutok::state::next(const int index)
 {
-    assert(lua_istable(_pimpl->lua_state, index));
-    assert(lua_gettop(_pimpl->lua_state) >= 1);
-    lua_pushcfunction(_pimpl->lua_state, protected_next);
-    lua_pushvalue(_pimpl->lua_state, index < 0 ? index - 1 : index);
-    lua_pushvalue(_pimpl->lua_state, -3);
-    if (lua_pcall(_pimpl->lua_state, 2, LUA_MULTRET, 0) != 0)
+    assert(lua_istable(_lua_state, index));
+    assert(lua_gettop(_lua_state) >= 1);
+    if (_protected_region)
+        return lua_next(_lua_state, index) != 0;
+    lua_pushcfunction(_lua_state, protected_next);
+    lua_pushvalue(_lua_state, index < 0 ? index - 1 : index);
+    lua_pushvalue(_lua_state, -3);
+    if (lua_pcall(_lua_state, 2, LUA_MULTRET, 0) != 0)
         throw lutok::api_error::from_stack(*this, "lua_next");
-    const bool more = (lua_toboolean(_pimpl->lua_state, -1)==1);
-    lua_pop(_pimpl->lua_state, 1);
+    const bool more = (lua_toboolean(_lua_state, -1)==1);
+    lua_pop(_lua_state, 1);
     if (more)
-        lua_remove(_pimpl->lua_state, -3);
+        lua_remove(_lua_state, -3);
     else
-        lua_pop(_pimpl->lua_state, 1);
+        lua_pop(_lua_state, 1);
     return more;
 }
 
@@ -615,8 +752,8 @@ lutok::state::next(const int index)
 void
 lutok::state::open_base(void)
 {
-    lua_pushcfunction(_pimpl->lua_state, luaopen_base);
-    if (lua_pcall(_pimpl->lua_state, 0, 0, 0) != 0)
+    lua_pushcfunction(_lua_state, luaopen_base);
+    if (lua_pcall(_lua_state, 0, 0, 0) != 0)
         throw lutok::api_error::from_stack(*this, "luaopen_base");
 }
 
@@ -629,8 +766,8 @@ lutok::state::open_base(void)
 void
 lutok::state::open_string(void)
 {
-    lua_pushcfunction(_pimpl->lua_state, luaopen_string);
-    if (lua_pcall(_pimpl->lua_state, 0, 0, 0) != 0)
+    lua_pushcfunction(_lua_state, luaopen_string);
+    if (lua_pcall(_lua_state, 0, 0, 0) != 0)
         throw lutok::api_error::from_stack(*this, "luaopen_string");
 }
 
@@ -643,8 +780,8 @@ lutok::state::open_string(void)
 void
 lutok::state::open_table(void)
 {
-    lua_pushcfunction(_pimpl->lua_state, luaopen_table);
-    if (lua_pcall(_pimpl->lua_state, 0, 0, 0) != 0)
+    lua_pushcfunction(_lua_state, luaopen_table);
+    if (lua_pcall(_lua_state, 0, 0, 0) != 0)
         throw lutok::api_error::from_stack(*this, "luaopen_table");
 }
 
@@ -659,8 +796,47 @@ lutok::state::open_table(void)
 void
 lutok::state::pcall(const int nargs, const int nresults, const int errfunc)
 {
-    if (lua_pcall(_pimpl->lua_state, nargs, nresults, errfunc) != 0)
+    if (lua_pcall(_lua_state, nargs, nresults, errfunc) != 0)
+        throw lutok::api_error::from_stack(*this, "lua_pcall");
+}
+
+
+/// Runs a function inside a protected region.
+///
+/// This is internal.  The public type-safe interface of this method, protect(),
+/// should be used instead.
+///
+/// \param function The function that invokes the callable.
+/// \param callable The callable to pass to function.
+/// \param nargs The number of arguments to pass to the region.
+/// \param nresults The number of results to return from the region.
+///
+/// \throw api_error If the region raises a Lua error.
+void
+lutok::state::protect_voidp(void (*function)(state&, void*), void* callable,
+                            const int nargs, const int nresults)
+{
+    assert(nargs >= 0 && lua_gettop(_lua_state) >= nargs);
+
+    state region_state(static_cast< void* >(_lua_state));
+    region_state._protected_region = true;
+
+    protected_region region;
+    region.function = function;
+    region.callable = callable;
+    region.region_state = &region_state;
+
+    lua_pushcfunction(_lua_state, protected_region_trampoline);
+    lua_pushlightuserdata(_lua_state, &region);
+    lua_insert(_lua_state, -(nargs + 2));
+    lua_insert(_lua_state, -(nargs + 2));
+    if (lua_pcall(_lua_state, nargs + 1, nresults, 0) != 0) {
+        if (region.exception) {
+            lua_pop(_lua_state, 1);
+            std::rethrow_exception(region.exception);
+        }
         throw lutok::api_error::from_stack(*this, "lua_pcall");
+    }
 }
 
 
@@ -670,9 +846,9 @@ lutok::state::pcall(const int nargs, const int nresults, const int errfunc)
 void
 lutok::state::pop(const int count)
 {
-    assert(count <= lua_gettop(_pimpl->lua_state));
-    lua_pop(_pimpl->lua_state, count);
-    assert(lua_gettop(_pimpl->lua_state) >= 0);
+    assert(count <= lua_gettop(_lua_state));
+    lua_pop(_lua_state, count);
+    assert(lua_gettop(_lua_state) >= 0);
 }
 
 
@@ -682,7 +858,17 @@ lutok::state::pop(const int count)
 void
 lutok::state::push_boolean(const bool value)
 {
-    lua_pushboolean(_pimpl->lua_state, value ? 1 : 0);
+    lua_pushboolean(_lua_state, value ? 1 : 0);
+}
+
+
+/// Wrapper around lua_pushcfunction.
+///
+/// \param function The C function to be pushed.
+void
+lutok::state::push_c_function(c_function function)
+{
+    lua_pushcfunction(_lua_state, function);
 }
 
 
@@ -696,10 +882,17 @@ lutok::state::push_boolean(const bool value)
 void
 lutok::state::push_cxx_closure(cxx_function function, const int nvalues)
 {
+    const int ntrampolines = static_cast< int >(
+        sizeof(cxx_closure_trampolines) / sizeof(cxx_closure_trampolines[0]));
+    assert(nvalues >= 0);
+
     cxx_function *data = static_cast< cxx_function* >(
-        lua_newuserdata(_pimpl->lua_state, sizeof(cxx_function)));
+        lua_newuserdata(_lua_state, sizeof(cxx_function)));
     *data = function;
-    lua_pushcclosure(_pimpl->lua_state, cxx_closure_trampoline, nvalues + 1);
+    lua_pushcclosure(_lua_state,
+                     nvalues < ntrampolines ? cxx_closure_trampolines[nvalues] :
+                                              cxx_closure_trampoline,
+                     nvalues + 1);
 }
 
 
@@ -713,9 +906,9 @@ void
 lutok::state::push_cxx_function(cxx_function function)
 {
     cxx_function *data = static_cast< cxx_function* >(
-        lua_newuserdata(_pimpl->lua_state, sizeof(cxx_function)));
+        lua_newuserdata(_lua_state, sizeof(cxx_function)));
     *data = function;
-    lua_pushcclosure(_pimpl->lua_state, cxx_function_trampoline, 1);
+    lua_pushcclosure(_lua_state, cxx_function_trampoline, 1);
 }
 
 
@@ -725,7 +918,7 @@ lutok::state::push_cxx_function(cxx_function function)
 void
 lutok::state::push_integer(const int value)
 {
-    lua_pushinteger(_pimpl->lua_state, value);
+    lua_pushinteger(_lua_state, value);
 }
 
 
@@ -733,7 +926,7 @@ lutok::state::push_integer(const int value)
 void
 lutok::state::push_nil(void)
 {
-    lua_pushnil(_pimpl->lua_state);
+    lua_pushnil(_lua_state);
 }
 
 
@@ -745,17 +938,17 @@ lutok::state::push_nil(void)
 void
 lutok::state::push_string(const std::string& str)
 {
-    lua_pushstring(_pimpl->lua_state, str.c_str());
+    lua_pushstring(_lua_state, str.c_str());
 }
 
 void lutok::state::push_lstring(const char * str, size_t len){
-	lua_pushlstring(_pimpl->lua_state, str, len);
+	lua_pushlstring(_lua_state, str, len);
 }
 
 void
 lutok::state::push_literal(const std::string& str)
 {
-	lua_pushlstring(_pimpl->lua_state, str.c_str(), str.size());
+	lua_pushlstring(_lua_state, str.c_str(), str.size());
 }
 
 /// Wrapper around lua_pushvalue.
@@ -764,22 +957,36 @@ lutok::state::push_literal(const std::string& str)
 void
 lutok::state::push_value(const int index)
 {
-    lua_pushvalue(_pimpl->lua_state, index);
+    lua_pushvalue(_lua_state, index);
 }
 
 
 /// Wrapper around lua_rawget.
 ///
+/// This is the fast, unprotected counterpart of get_table(): it neither runs
+/// a lua_pcall nor triggers metamethods.
+///
+/// \pre stack(index) is a table.
+/// \pre stack(-1) is the key to look up.
+///
 /// \param index The second parameter to lua_rawget.
 void
 lutok::state::raw_get(const int index)
 {
-    lua_rawget(_pimpl->lua_state, index);
+    assert(lua_istable(_lua_state, index));
+    lua_rawget(_lua_state, index);
 }
 
 
 /// Wrapper around lua_rawset.
 ///
+/// This is the fast, unprotected counterpart of set_table(): it neither runs
+/// a lua_pcall nor triggers metamethods.
+///
+/// \pre stack(index) is a table.
+/// \pre stack(-2) is the key, which must not be nil.
+/// \pre stack(-1) is the value to set.
+///
 /// \param index The second parameter to lua_rawset.
 ///
 /// \warning Terminates execution if there is not enough memory to manipulate
@@ -787,11 +994,101 @@ lutok::state::raw_get(const int index)
 void
 lutok::state::raw_set(const int index)
 {
-    lua_rawset(_pimpl->lua_state, index);
+    assert(lua_istable(_lua_state, index));
+    assert(!lua_isnil(_lua_state, -2));
+    lua_rawset(_lua_state, index);
+}
+
+
+/// Fast, unprotected counterpart of get_global().
+///
+/// The global is read with lua_rawget, so metamethods of the globals table
+/// are ignored.
+///
+/// \param name The name of the global to get.
+void
+lutok::state::raw_get_global(const std::string& name)
+{
+    lua_pushlstring(_lua_state, name.c_str(), name.size());
+    lua_rawget(_lua_state, LUA_GLOBALSINDEX);
+}
+
+
+/// Fast, unprotected counterpart of set_global().
+///
+/// The global is written with lua_rawset, so metamethods of the globals table
+/// are ignored.
+///
+/// \pre stack(-1) is the value to set the global to.
+///
+/// \param name The name of the global to set.
+///
+/// \warning Terminates execution if there is not enough memory.
+void
+lutok::state::raw_set_global(const std::string& name)
+{
+    assert(lua_gettop(_lua_state) >= 1);
+    lua_pushlstring(_lua_state, name.c_str(), name.size());
+    lua_insert(_lua_state, -2);
+    lua_rawset(_lua_state, LUA_GLOBALSINDEX);
+}
+
+
+/// Fast, unprotected counterpart of get_field().
+///
+/// \pre stack(index) is a table.
+///
+/// \param index The stack index of the table.
+/// \param name The name of the field to get.
+void
+lutok::state::raw_get_field(const int index, const std::string& name)
+{
+    assert(lua_istable(_lua_state, index));
+    const int table = (index < 0 && index > LUA_REGISTRYINDEX) ? index - 1 :
+                      index;
+    lua_pushlstring(_lua_state, name.c_str(), name.size());
+    lua_rawget(_lua_state, table);
+}
+
+
+/// Fast, unprotected counterpart of set_field(int, string).
+///
+/// \pre stack(index) is a table.
+/// \pre stack(-1) is the value to set.
+///
+/// \param index The stack index of the table.
+/// \param name The name of the field to set.
+///
+/// \warning Terminates execution if there is not enough memory.
+void
+lutok::state::raw_set_field(const int index, const std::string& name)
+{
+    assert(lua_istable(_lua_state, index));
+    const int table = (index < 0 && index > LUA_REGISTRYINDEX) ? index - 1 :
+                      index;
+    lua_pushlstring(_lua_state, name.c_str(), name.size());
+    lua_insert(_lua_state, -2);
+    lua_rawset(_lua_state, table);
+}
+
+
+/// Fast, unprotected counterpart of lua_next.
+///
+/// \pre stack(index) is a table.
+/// \pre stack(-1) is the last processed key, or nil to start the traversal.
+///
+/// \param index The stack index of the table.
+///
+/// \return True if there are more elements to process; false otherwise.
+bool
+lutok::state::raw_next(const int index)
+{
+    assert(lua_istable(_lua_state, index));
+    return lua_next(_lua_state, index) != 0;
 }
 
 void lutok::state::concat(const int n){
-	lua_concat(_pimpl->lua_state, n);
+	lua_concat(_lua_state, n);
 }
 
 /// Wrapper around lua_setglobal.
@@ -805,12 +1102,16 @@ void lutok::state::concat(const int n){
 void
 lutok::state::set_global(const std::string& name)
 {
-    lua_pushcfunction(_pimpl->lua_state, protected_setglobal);
-    lua_pushstring(_pimpl->lua_state, name.c_str());
-    lua_pushvalue(_pimpl->lua_state, -3);
-    if (lua_pcall(_pimpl->lua_state, 2, 0, 0) != 0)
+    if (_protected_region) {
+        lua_setglobal(_lua_state, name.c_str());
+        return;
+    }
+    lua_pushcfunction(_lua_state, protected_setglobal);
+    lua_pushstring(_lua_state, name.c_str());
+    lua_pushvalue(_lua_state, -3);
+    if (lua_pcall(_lua_state, 2, 0, 0) != 0)
         throw lutok::api_error::from_stack(*this, "lua_setglobal");
-    lua_pop(_pimpl->lua_state, 1);
+    lua_pop(_lua_state, 1);
 }
 
 
@@ -820,7 +1121,7 @@ lutok::state::set_global(const std::string& name)
 void
 lutok::state::set_metatable(const int index)
 {
-    lua_setmetatable(_pimpl->lua_state, index);
+    lua_setmetatable(_lua_state, index);
 }
 
 
@@ -835,13 +1136,17 @@ lutok::state::set_metatable(const int index)
 void
 lutok::state::set_table(const int index)
 {
-    lua_pushcfunction(_pimpl->lua_state, protected_settable);
-    lua_pushvalue(_pimpl->lua_state, index < 0 ? index - 1 : index);
-    lua_pushvalue(_pimpl->lua_state, -4);
-    lua_pushvalue(_pimpl->lua_state, -4);
-    if (lua_pcall(_pimpl->lua_state, 3, 0, 0) != 0)
+    if (_protected_region) {
+        lua_settable(_lua_state, index);
+        return;
+    }
+    lua_pushcfunction(_lua_state, protected_settable);
+    lua_pushvalue(_lua_state, index < 0 ? index - 1 : index);
+    lua_pushvalue(_lua_state, -4);
+    lua_pushvalue(_lua_state, -4);
+    if (lua_pcall(_lua_state, 3, 0, 0) != 0)
         throw lutok::api_error::from_stack(*this, "lua_settable");
-    lua_pop(_pimpl->lua_state, 2);
+    lua_pop(_lua_state, 2);
 }
 
 
@@ -854,7 +1159,7 @@ bool
 lutok::state::to_boolean(const int index)
 {
     assert(is_boolean(index));
-    return (lua_toboolean(_pimpl->lua_state, index)==1);
+    return (lua_toboolean(_lua_state, index)==1);
 }
 
 
@@ -867,7 +1172,7 @@ long
 lutok::state::to_integer(const int index)
 {
     assert(is_number(index));
-    return lua_tointeger(_pimpl->lua_state, index);
+    return lua_tointeger(_lua_state, index);
 }
 
 
@@ -884,7 +1189,7 @@ lutok::state::to_integer(const int index)
 void*
 lutok::state::to_userdata_voidp(const int index)
 {
-    return lua_touserdata(_pimpl->lua_state, index);
+    return lua_touserdata(_lua_state, index);
 }
 
 
@@ -900,7 +1205,7 @@ std::string
 lutok::state::to_string(const int index)
 {
     assert(is_string(index));
-    const char *raw_string = lua_tostring(_pimpl->lua_state, index);
+    const char *raw_string = lua_tostring(_lua_state, index);
     // Note that the creation of a string object below (explicit for clarity)
     // implies that the raw string is duplicated and, henceforth, the string is
     // safe even if the corresponding element is popped from the Lua stack.
@@ -919,13 +1224,30 @@ std::string
 {
 	assert(is_string(index));
 	size_t len = 0;
-	const char *raw_string = lua_tolstring(_pimpl->lua_state, index, &len);
+	const char *raw_string = lua_tolstring(_lua_state, index, &len);
 	// Note that the creation of a string object below (explicit for clarity)
 	// implies that the raw string is duplicated and, henceforth, the string is
 	// safe even if the corresponding element is popped from the Lua stack.
 	return std::string(raw_string, len);
 }
 
+/// Wrapper around lua_tolstring that does not copy the string.
+///
+/// \param index The second parameter to lua_tolstring.
+///
+/// \return A view of the string, valid while the value stays on the stack.
+/// Anchor the value with a string_guard to use the view after popping it.
+///
+/// \warning Terminates execution if there is not enough memory.
+lutok::string_ref
+lutok::state::to_string_ref(const int index)
+{
+	assert(is_string(index));
+	size_t len = 0;
+	const char *raw_string = lua_tolstring(_lua_state, index, &len);
+	return string_ref(raw_string, len);
+}
+
 /// Wrapper around lua_upvalueindex.
 ///
 /// \param index The first parameter to lua_upvalueindex.
@@ -947,86 +1269,86 @@ lutok::state::upvalue_index(const int index)
 void*
 lutok::state::raw_state(void)
 {
-    return _pimpl->lua_state;
+    return _lua_state;
 }
 
 void lutok::state::findLib(const std::string& name, const int size, const int nup){
 	const char * libname = name.c_str();
 
-	luaL_findtable(_pimpl->lua_state, LUA_REGISTRYINDEX, "_LOADED", 1);
-    lua_getfield(_pimpl->lua_state, -1, libname);  /* get _LOADED[libname] */
-    if (!lua_istable(_pimpl->lua_state, -1)) {  /* not found? */
-      lua_pop(_pimpl->lua_state, 1);  /* remove previous result */
+	luaL_findtable(_lua_state, LUA_REGISTRYINDEX, "_LOADED", 1);
+    lua_getfield(_lua_state, -1, libname);  /* get _LOADED[libname] */
+    if (!lua_istable(_lua_state, -1)) {  /* not found? */
+      lua_pop(_lua_state, 1);  /* remove previous result */
       /* try global variable (and create one if it does not exist) */
-	  if (luaL_findtable(_pimpl->lua_state, LUA_GLOBALSINDEX, libname, size ) != NULL)
-        luaL_error(_pimpl->lua_state, "name conflict for module " LUA_QS, libname);
-      lua_pushvalue(_pimpl->lua_state, -1);
-      lua_setfield(_pimpl->lua_state, -3, libname);  /* _LOADED[libname] = new table */
+	  if (luaL_findtable(_lua_state, LUA_GLOBALSINDEX, libname, size ) != NULL)
+        luaL_error(_lua_state, "name conflict for module " LUA_QS, libname);
+      lua_pushvalue(_lua_state, -1);
+      lua_setfield(_lua_state, -3, libname);  /* _LOADED[libname] = new table */
     }
-    lua_remove(_pimpl->lua_state, -2);  /* remove _LOADED table */
-    lua_insert(_pimpl->lua_state, -(nup+1));  /* move library table to below upvalues */
+    lua_remove(_lua_state, -2);  /* remove _LOADED table */
+    lua_insert(_lua_state, -(nup+1));  /* move library table to below upvalues */
 }
 
 void lutok::state::push_lightuserdata(void * data){
-	lua_pushlightuserdata(_pimpl->lua_state, data);
+	lua_pushlightuserdata(_lua_state, data);
 }
 
 void lutok::state::push_userdata(const void * data, const std::string& name){
-	luaL_getmetatable(_pimpl->lua_state, "lua_userdata");
+	luaL_getmetatable(_lua_state, "lua_userdata");
 	
 	if(!is_table()){
-		lua_pop(_pimpl->lua_state, 1);
+		lua_pop(_lua_state, 1);
         // create new weak table
-        luaL_newmetatable( _pimpl->lua_state, "lua_userdata" );
+        luaL_newmetatable( _lua_state, "lua_userdata" );
 		push_string("v");
-        lua_setfield( _pimpl->lua_state, -2, "__mode" );
+        lua_setfield( _lua_state, -2, "__mode" );
     }
 
-	lua_getfield( _pimpl->lua_state, -1, name.c_str());
+	lua_getfield( _lua_state, -1, name.c_str());
     if( is_userdata())
-		return lua_remove( _pimpl->lua_state, -2 );
+		return lua_remove( _lua_state, -2 );
 
 	pop(1);// didnt exist yet - getfield is nil -> need to pop that
 
-	void * userdata = lua_newuserdata(_pimpl->lua_state, sizeof(void *));
+	void * userdata = lua_newuserdata(_lua_state, sizeof(void *));
 	*reinterpret_cast<void **>( userdata ) = (void *)( data );
 
 	this->push_value();
-	lua_setfield( _pimpl->lua_state, -3, name.c_str());
-    lua_remove( _pimpl->lua_state, -2 );
+	lua_setfield( _lua_state, -3, name.c_str());
+    lua_remove( _lua_state, -2 );
 }
 
 void lutok::state::push_userdata(const void * data){
 	//cache table for: data_address -> full userdata pairs
-	luaL_getmetatable(_pimpl->lua_state, "lua_userdata");
+	luaL_getmetatable(_lua_state, "lua_userdata");
 
 	if(!is_table()){
-		lua_pop(_pimpl->lua_state, 1);
+		lua_pop(_lua_state, 1);
 
 		// create new weak table
-		luaL_newmetatable( _pimpl->lua_state, "lua_userdata" );
+		luaL_newmetatable( _lua_state, "lua_userdata" );
 		push_string("v");
-		lua_setfield( _pimpl->lua_state, -2, "__mode" );
+		lua_setfield( _lua_state, -2, "__mode" );
 	}
 
-	lua_pushlightuserdata(_pimpl->lua_state, (void*)data); //key
-	lua_gettable(_pimpl->lua_state, -2); //lua_userdata[key]
+	lua_pushlightuserdata(_lua_state, (void*)data); //key
+	lua_gettable(_lua_state, -2); //lua_userdata[key]
 	
 	if( is_userdata()){ //is userdata cached?
-		lua_remove( _pimpl->lua_state, -2 ); //remove metatable from stack
+		lua_remove( _lua_state, -2 ); //remove metatable from stack
 		return;
 	}else{
 		pop(1);// didn't exist yet - getfield is nil -> need to pop that
 		/*
 			1 - lua_userdata
 		*/
-		void * userdata = lua_newuserdata(_pimpl->lua_state, sizeof(void *));
+		void * userdata = lua_newuserdata(_lua_state, sizeof(void *));
 		*reinterpret_cast<void **>( userdata ) = (void *)( data );
 		/*
 			1 - lua_userdata
 			2 - full userdata
 		*/
-		lua_pushlightuserdata(_pimpl->lua_state, (void*)data); //key
+		lua_pushlightuserdata(_lua_state, (void*)data); //key
 		this->push_value(-2); //value
 		/*
 			1 - lua_userdata
@@ -1034,12 +1356,12 @@ void lutok::state::push_userdata(const void * data){
 			3 - light user data
 			4 - full userdata
 		*/
-		lua_settable(_pimpl->lua_state, -4);
+		lua_settable(_lua_state, -4);
 		/*
 			1 - lua_userdata
 			2 - full userdata
 		*/
-		lua_remove( _pimpl->lua_state, -2 );
+		lua_remove( _lua_state, -2 );
 	}
 }
 
@@ -1063,45 +1385,208 @@ void lutok::state::set_field(const std::string& name, const bool value, const in
 	push_boolean(value);
 	set_table(index);
 }
+
+/// Fast, unprotected counterparts of the set_field() overloads.
+///
+/// These push the key and the value and store them with lua_rawset, so they
+/// neither run a lua_pcall nor trigger metamethods.  As in set_field(), the
+/// table index is relative to the stack after both values have been pushed.
+///
+/// \pre stack(index) is a table once the key and the value are pushed.
+///
+/// \param name The name of the field to set.
+/// \param value The value to store.
+/// \param index The stack index of the table.
+void lutok::state::raw_set_field(const std::string& name, const lua_Number value, const int index){
+	lua_pushlstring(_lua_state, name.c_str(), name.size());
+	lua_pushnumber(_lua_state, value);
+	assert(lua_istable(_lua_state, index));
+	lua_rawset(_lua_state, index);
+}
+void lutok::state::raw_set_field(const std::string& name, const int value, const int index){
+	lua_pushlstring(_lua_state, name.c_str(), name.size());
+	lua_pushinteger(_lua_state, value);
+	assert(lua_istable(_lua_state, index));
+	lua_rawset(_lua_state, index);
+}
+void lutok::state::raw_set_field(const std::string& name, const char * value, const int index){
+	lua_pushlstring(_lua_state, name.c_str(), name.size());
+	lua_pushstring(_lua_state, value);
+	assert(lua_istable(_lua_state, index));
+	lua_rawset(_lua_state, index);
+}
+void lutok::state::raw_set_field(const std::string& name, const std::string& value, const int index){
+	lua_pushlstring(_lua_state, name.c_str(), name.size());
+	lua_pushlstring(_lua_state, value.c_str(), value.size());
+	assert(lua_istable(_lua_state, index));
+	lua_rawset(_lua_state, index);
+}
+void lutok::state::raw_set_field(const std::string& name, const bool value, const int index){
+	lua_pushlstring(_lua_state, name.c_str(), name.size());
+	lua_pushboolean(_lua_state, value ? 1 : 0);
+	assert(lua_istable(_lua_state, index));
+	lua_rawset(_lua_state, index);
+}
+
 void lutok::state::set_field(const int index, const std::string& name){
-	lua_setfield(_pimpl->lua_state, index, name.c_str());
+	lua_setfield(_lua_state, index, name.c_str());
 }
 
 void lutok::state::get_field(const int index, const std::string& name){
-	lua_getfield(_pimpl->lua_state, index, name.c_str());
+	lua_getfield(_lua_state, index, name.c_str());
+}
+
+/// Pushes the interned string of a key.
+///
+/// \param k The key, which must belong to this state.
+void
+lutok::state::push_key(const key& k)
+{
+    lua_rawgeti(_lua_state, LUA_REGISTRYINDEX, k.reference());
+}
+
+/// Counterpart of get_field(int, string) taking an interned key.
+///
+/// Like lua_getfield, this honors the metamethods of the table.
+///
+/// \param index The stack index of the table.
+/// \param k The key of the field to get.
+void
+lutok::state::get_field(const int index, const key& k)
+{
+    const int table = (index < 0 && index > LUA_REGISTRYINDEX) ? index - 1 :
+                      index;
+    lua_rawgeti(_lua_state, LUA_REGISTRYINDEX, k.reference());
+    lua_gettable(_lua_state, table);
+}
+
+/// Counterpart of set_field(int, string) taking an interned key.
+///
+/// Like lua_setfield, this honors the metamethods of the table.
+///
+/// \pre stack(-1) is the value to set, which is popped.
+///
+/// \param index The stack index of the table.
+/// \param k The key of the field to set.
+void
+lutok::state::set_field(const int index, const key& k)
+{
+    const int table = (index < 0 && index > LUA_REGISTRYINDEX) ? index - 1 :
+                      index;
+    lua_rawgeti(_lua_state, LUA_REGISTRYINDEX, k.reference());
+    lua_insert(_lua_state, -2);
+    lua_settable(_lua_state, table);
+}
+
+/// Fast counterpart of get_field(int, key) that skips metamethods.
+///
+/// \pre stack(index) is a table.
+///
+/// \param index The stack index of the table.
+/// \param k The key of the field to get.
+void
+lutok::state::raw_get_field(const int index, const key& k)
+{
+    assert(lua_istable(_lua_state, index));
+    const int table = (index < 0 && index > LUA_REGISTRYINDEX) ? index - 1 :
+                      index;
+    lua_rawgeti(_lua_state, LUA_REGISTRYINDEX, k.reference());
+    lua_rawget(_lua_state, table);
+}
+
+/// Fast counterpart of set_field(int, key) that skips metamethods.
+///
+/// \pre stack(index) is a table.
+/// \pre stack(-1) is the value to set, which is popped.
+///
+/// \param index The stack index of the table.
+/// \param k The key of the field to set.
+void
+lutok::state::raw_set_field(const int index, const key& k)
+{
+    assert(lua_istable(_lua_state, index));
+    const int table = (index < 0 && index > LUA_REGISTRYINDEX) ? index - 1 :
+                      index;
+    lua_rawgeti(_lua_state, LUA_REGISTRYINDEX, k.reference());
+    lua_insert(_lua_state, -2);
+    lua_rawset(_lua_state, table);
 }
 
 void lutok::state::push_number(const double value){
-	lua_pushnumber(_pimpl->lua_state, static_cast<lua_Number>(value));
+	lua_pushnumber(_lua_state, static_cast<lua_Number>(value));
 }
 
 const double lutok::state::to_number(const int index){
 	assert(is_number(index));
-    return lua_tonumber(_pimpl->lua_state, index);
+    return lua_tonumber(_lua_state, index);
 }
 
 void lutok::state::remove(const int index){
-	lua_remove(_pimpl->lua_state, index);
+	lua_remove(_lua_state, index);
 }
 
 void lutok::state::replace(const int index){
-	lua_replace(_pimpl->lua_state, index);
+	lua_replace(_lua_state, index);
 }
 
 bool lutok::state::new_metatable(const std::string& name){
-	return (luaL_newmetatable(_pimpl->lua_state, name.c_str()) == 1);
+	return (luaL_newmetatable(_lua_state, name.c_str()) == 1);
+}
+
+/// Same as new_metatable(name) but preallocates the hash part of the table.
+///
+/// \param name The registry name of the metatable.
+/// \param nrec Number of named fields the metatable is expected to hold.
+///
+/// \return False if a metatable with that name already exists; it is pushed
+/// onto the stack regardless.
+bool lutok::state::new_metatable(const std::string& name, const int nrec){
+	lua_pushlstring(_lua_state, name.c_str(), name.size());
+	lua_rawget(_lua_state, LUA_REGISTRYINDEX);
+	if (!lua_isnil(_lua_state, -1))
+		return false;
+	lua_pop(_lua_state, 1);
+	lua_createtable(_lua_state, 0, nrec);
+	lua_pushlstring(_lua_state, name.c_str(), name.size());
+	lua_pushvalue(_lua_state, -2);
+	lua_rawset(_lua_state, LUA_REGISTRYINDEX);
+	return true;
 }
 
 void lutok::state::get_metatable(const std::string& name){
-	luaL_getmetatable(_pimpl->lua_state, name.c_str());
+	luaL_getmetatable(_lua_state, name.c_str());
 }
 
 void * lutok::state::getLuaState(){
-	return static_cast<void*>(_pimpl->lua_state);
+	return static_cast<void*>(_lua_state);
+}
+
+/// Returns the main thread of the Lua session this state belongs to.
+///
+/// Objects living as long as the session, like LObject class instances, must
+/// keep the main thread: a coroutine may be left suspended or be collected
+/// long before the session ends.  Lua 5.1 cannot reach the main thread from a
+/// coroutine, so it is recorded in the registry by new_state() or by the first
+/// call made on it.  A session first seen through a coroutine records that
+/// coroutine instead, which the registry then keeps alive.
+///
+/// \return The raw Lua state of the main thread.
+void * lutok::state::getMainLuaState(){
+	lua_pushlightuserdata(_lua_state, &main_thread_key);
+	lua_rawget(_lua_state, LUA_REGISTRYINDEX);
+	lua_State * main = lua_tothread(_lua_state, -1);
+	lua_pop(_lua_state, 1);
+	if (main == NULL){
+		lua_pushlightuserdata(_lua_state, &main_thread_key);
+		lua_pushthread(_lua_state);
+		lua_rawset(_lua_state, LUA_REGISTRYINDEX);
+		main = _lua_state;
+	}
+	return static_cast<void*>(main);
 }
 
 void lutok::state::error(const std::string& text){
-	luaL_error(_pimpl->lua_state, "%s", text.c_str());
+	luaL_error(_lua_state, "%s", text.c_str());
 }
 
 void lutok::state::error(const char * fmt, ...){
@@ -1109,12 +1594,12 @@ void lutok::state::error(const char * fmt, ...){
 	va_list args;
 	va_start (args, fmt);
 	vsprintf (buffer,fmt, args);
-	luaL_error(_pimpl->lua_state, "%s", buffer);
+	luaL_error(_lua_state, "%s", buffer);
 	va_end (args);
 }
 
 void* lutok::state::check_userdata_voidp(const int narg, const std::string& name){
-	return luaL_checkudata(_pimpl->lua_state, narg, name.c_str());
+	return luaL_checkudata(_lua_state, narg, name.c_str());
 }
 
 void lutok::state::push_fstring(const char * fmt, ...){
@@ -1122,115 +1607,279 @@ void lutok::state::push_fstring(const char * fmt, ...){
 	va_list args;
 	va_start (args, fmt);
 	vsprintf (buffer,fmt, args);
-	lua_pushstring(_pimpl->lua_state, buffer);
+	lua_pushstring(_lua_state, buffer);
 	va_end (args);
 }
 
 const void* lutok::state::to_lightuserdata(const int index){
-	return lua_touserdata(_pimpl->lua_state, index);
+	return lua_touserdata(_lua_state, index);
 }
 
 int lutok::state::ref(){
-	return luaL_ref(_pimpl->lua_state, LUA_REGISTRYINDEX);
+	return luaL_ref(_lua_state, LUA_REGISTRYINDEX);
 }
 
 int lutok::state::ref(const int index){
-	return luaL_ref(_pimpl->lua_state, index);
+	return luaL_ref(_lua_state, index);
 }
 
 void lutok::state::unref(const int t, const int index){
-	luaL_unref(_pimpl->lua_state, t, index);
+	luaL_unref(_lua_state, t, index);
 }
 
 void lutok::state::unref(const int index){
-	luaL_unref(_pimpl->lua_state, LUA_REGISTRYINDEX, index);
+	luaL_unref(_lua_state, LUA_REGISTRYINDEX, index);
 }
 
 void lutok::state::raw_geti(const int tindex, const int index)
 {
-    lua_rawgeti(_pimpl->lua_state, tindex, index);
+    lua_rawgeti(_lua_state, tindex, index);
 }
 
 const size_t lutok::state::obj_len(const int index)
 {
-	return lua_objlen(_pimpl->lua_state, index);
+	return lua_objlen(_lua_state, index);
 }
 
 lutok::state * lutok::state::newState(){
 	return new lutok::state(luaL_newstate());
 }
 void lutok::state::openLibs(){
-	luaL_openlibs(_pimpl->lua_state);
+	luaL_openlibs(_lua_state);
 }
 void lutok::state::cpcall(cxx_function_ex function, void * arg){
-	cxx_function_ex_holder *data = static_cast< cxx_function_ex_holder* >(
-		lua_newuserdata(_pimpl->lua_state, sizeof(cxx_function_ex_holder)));
-	
-	data->function = function;
-	data->arg = arg;
-	lua_cpcall(_pimpl->lua_state, cxx_function_trampoline_ex, data);
+	cxx_function_ex_holder holder;
+	holder.function = function;
+	holder.arg = arg;
+	lua_cpcall(_lua_state, cxx_function_trampoline_ex, &holder);
 }
 
 void lutok::state::set_top(int i){
-	lua_settop(_pimpl->lua_state, i);
+	lua_settop(_lua_state, i);
 }
 
 const char * lutok::state::typeName(int i){
-	return lua_typename(_pimpl->lua_state, lua_type(_pimpl->lua_state, i));
+	return lua_typename(_lua_state, lua_type(_lua_state, i));
 }
 
 const int lutok::state::type(int i){
-	return lua_type(_pimpl->lua_state, i);
+	return lua_type(_lua_state, i);
 }
 
 void lutok::state::xmove(lutok::state target, int n){
-	lua_xmove(_pimpl->lua_state, target._pimpl->lua_state, n);
+	lua_xmove(_lua_state, target._lua_state, n);
 }
 
 int lutok::state::resume(const int nargs){
-	return lua_resume(_pimpl->lua_state, nargs);
+	return lua_resume(_lua_state, nargs);
 }
 
 int lutok::state::yield(const int nargs){
-	return lua_yield(_pimpl->lua_state, nargs);
+	return lua_yield(_lua_state, nargs);
 }
 
 namespace lutok {
 
 template<> double state::get_array<double>(const int table_index, const int index){
-	lua_pushinteger(_pimpl->lua_state, index);
-	lua_gettable(_pimpl->lua_state, table_index);
-	double result = lua_tonumber(_pimpl->lua_state, -1);
-	lua_pop(_pimpl->lua_state, 1);
+	lua_pushinteger(_lua_state, index);
+	lua_gettable(_lua_state, table_index);
+	double result = lua_tonumber(_lua_state, -1);
+	lua_pop(_lua_state, 1);
 	return result;
 }
 template<> float state::get_array<float>(const int table_index, const int index){
-	lua_pushinteger(_pimpl->lua_state, index);
-	lua_gettable(_pimpl->lua_state, table_index);
-	float result = lua_tonumber(_pimpl->lua_state, -1);
-	lua_pop(_pimpl->lua_state, 1);
+	lua_pushinteger(_lua_state, index);
+	lua_gettable(_lua_state, table_index);
+	float result = lua_tonumber(_lua_state, -1);
+	lua_pop(_lua_state, 1);
 	return result;
 }
 template<> int state::get_array<int>(const int table_index, const int index){
-	lua_pushinteger(_pimpl->lua_state, index);
-	lua_gettable(_pimpl->lua_state, table_index);
-	int result = lua_tointeger(_pimpl->lua_state, -1);
-	lua_pop(_pimpl->lua_state, 1);
+	lua_pushinteger(_lua_state, index);
+	lua_gettable(_lua_state, table_index);
+	int result = lua_tointeger(_lua_state, -1);
+	lua_pop(_lua_state, 1);
 	return result;
 }
 template<> bool state::get_array<bool>(const int table_index, const int index){
-	lua_pushinteger(_pimpl->lua_state, index);
-	lua_gettable(_pimpl->lua_state, table_index);
-	bool result = lua_toboolean(_pimpl->lua_state, -1);
-	lua_pop(_pimpl->lua_state, 1);
+	lua_pushinteger(_lua_state, index);
+	lua_gettable(_lua_state, table_index);
+	bool result = lua_toboolean(_lua_state, -1);
+	lua_pop(_lua_state, 1);
 	return result;
 }
 template<> std::string state::get_array<std::string>(const int table_index, const int index){
-	lua_pushinteger(_pimpl->lua_state, index);
-	lua_gettable(_pimpl->lua_state, table_index);
-	const char *raw_string = lua_tostring(_pimpl->lua_state, -1);
-	lua_pop(_pimpl->lua_state, 1);
+	lua_pushinteger(_lua_state, index);
+	lua_gettable(_lua_state, table_index);
+	const char *raw_string = lua_tostring(_lua_state, -1);
+	lua_pop(_lua_state, 1);
 	return std::string(raw_string);
 }
 
-}
\ No newline at end of file
+}
+
+namespace {
+
+
+/// Conversion of the elements of to_vector() and push_vector().
+///
+/// Elements are read leniently, as get_array() does: anything that is not a
+/// number reads as zero.
+template< typename Type, typename Enable = void >
+struct vector_element {
+    static Type
+    get(lua_State* state, const int index)
+    {
+        return static_cast< Type >(lua_tonumber(state, index));
+    }
+
+    static void
+    push(lua_State* state, const Type value)
+    {
+        lua_pushnumber(state, static_cast< lua_Number >(value));
+    }
+};
+
+
+/// Conversion of integral elements.
+template< typename Type >
+struct vector_element< Type, typename std::enable_if<
+    std::is_integral< Type >::value && !std::is_same< Type, bool >::value
+    >::type > {
+    static Type
+    get(lua_State* state, const int index)
+    {
+        return static_cast< Type >(lua_tointeger(state, index));
+    }
+
+    static void
+    push(lua_State* state, const Type value)
+    {
+        lua_pushinteger(state, static_cast< lua_Integer >(value));
+    }
+};
+
+
+/// Conversion of boolean elements.
+template<>
+struct vector_element< bool > {
+    static bool
+    get(lua_State* state, const int index)
+    {
+        return lua_toboolean(state, index) != 0;
+    }
+
+    static void
+    push(lua_State* state, const bool value)
+    {
+        lua_pushboolean(state, value ? 1 : 0);
+    }
+};
+
+
+/// Conversion of string elements.
+///
+/// Unlike the numeric conversions this one is strict, as there is no sensible
+/// string to read a non-string element as.
+///
+/// \pre stack(-1) is the element, which is popped before throwing.
+template<>
+struct vector_element< std::string > {
+    static std::string
+    get(lua_State* state, const int index)
+    {
+        size_t length;
+        const char* value = lua_tolstring(state, index, &length);
+        if (value == NULL) {
+            lua_pop(state, 1);
+            throw lutok::error("Array element is not a string");
+        }
+        return std::string(value, length);
+    }
+
+    static void
+    push(lua_State* state, const std::string& value)
+    {
+        lua_pushlstring(state, value.c_str(), value.size());
+    }
+};
+
+
+}  // anonymous namespace
+
+
+/// Copies the array part of a table into a vector.
+///
+/// The elements 1 to #t are read in a single pass with raw accesses, so
+/// metamethods of the table are not honored.  This replaces one get_array()
+/// call, and its three API calls, per element.
+///
+/// \param index The stack index of the table.
+///
+/// \return The elements of the table, in order.
+///
+/// \throw error If the value at index is not a table, or if an element of a
+///     string array is not a string.
+template< typename Type >
+std::vector< Type >
+lutok::state::to_vector(const int index)
+{
+    if (!lua_istable(_lua_state, index))
+        throw lutok::error("to_vector: table expected");
+    const int table = (index < 0 && index > LUA_REGISTRYINDEX) ?
+        lua_gettop(_lua_state) + index + 1 : index;
+
+    const int length = static_cast< int >(lua_objlen(_lua_state, table));
+    std::vector< Type > result;
+    result.reserve(length);
+    for (int i = 1; i <= length; i++) {
+        lua_rawgeti(_lua_state, table, i);
+        result.push_back(vector_element< Type >::get(_lua_state, -1));
+        lua_pop(_lua_state, 1);
+    }
+    return result;
+}
+
+
+/// Pushes a new table holding the elements of a vector.
+///
+/// The table is created with its array part already sized for the vector and
+/// is filled with raw accesses, so it is never resized while being built.
+///
+/// \param values The elements to store at the indices 1 to values.size().
+template< typename Type >
+void
+lutok::state::push_vector(const std::vector< Type >& values)
+{
+    const int length = static_cast< int >(values.size());
+    lua_createtable(_lua_state, length, 0);
+    for (int i = 0; i < length; i++) {
+        vector_element< Type >::push(_lua_state, values[i]);
+        lua_rawseti(_lua_state, -2, i + 1);
+    }
+}
+
+
+#define LUTOK_INSTANTIATE_VECTOR(Type) \
+    template std::vector< Type > lutok::state::to_vector< Type >(const int); \
+    template void lutok::state::push_vector< Type >( \
+        const std::vector< Type >&);
+
+LUTOK_INSTANTIATE_VECTOR(bool)
+LUTOK_INSTANTIATE_VECTOR(char)
+LUTOK_INSTANTIATE_VECTOR(signed char)
+LUTOK_INSTANTIATE_VECTOR(unsigned char)
+LUTOK_INSTANTIATE_VECTOR(short)
+LUTOK_INSTANTIATE_VECTOR(unsigned short)
+LUTOK_INSTANTIATE_VECTOR(int)
+LUTOK_INSTANTIATE_VECTOR(unsigned int)
+LUTOK_INSTANTIATE_VECTOR(long)
+LUTOK_INSTANTIATE_VECTOR(unsigned long)
+LUTOK_INSTANTIATE_VECTOR(long long)
+LUTOK_INSTANTIATE_VECTOR(unsigned long long)
+LUTOK_INSTANTIATE_VECTOR(float)
+LUTOK_INSTANTIATE_VECTOR(double)
+LUTOK_INSTANTIATE_VECTOR(long double)
+LUTOK_INSTANTIATE_VECTOR(std::string)
+
+#undef LUTOK_INSTANTIATE_VECTOR
@@ -33,6 +33,10 @@
 #define LUTOK_STATE_HPP
 
 #include <string>
+#include <vector>
+
+#include <lutok/key.hpp>
+#include <lutok/string_ref.hpp>
 
 #ifdef _WIN32
     #include <memory>
@@ -40,6 +44,8 @@
     #include <tr1/memory>
 #endif
 
+struct lua_State;
+
 namespace lutok {
 
 
@@ -52,6 +58,13 @@ class state;
 /// propagate into the Lua C API.  However, any such exceptions will be reported
 /// as a Lua error and their type will be lost.
 typedef int (*cxx_function)(state&);
+
+/// The type of a plain C function that can be bound into Lua.
+///
+/// This is the same as lua_CFunction.  Functions of this type are pushed
+/// without any trampoline, so they must not let exceptions escape.  See
+/// bind.hpp to generate them from regular C++ functions.
+typedef int (*c_function)(lua_State*);
 typedef int (*cxx_function_ex)(void *);
 
 struct  cxx_function_ex_holder {
@@ -63,6 +76,9 @@ struct  cxx_function_ex_holder {
 /// Stack index constant pointing to the globals table (_G).
 extern const int globals_index;
 
+/// Stack index constant pointing to the registry table.
+extern const int registry_index;
+
 
 /// A RAII model for the Lua state.
 ///
@@ -82,8 +98,25 @@ class state {
     struct impl;
 
     /// Pointer to the shared internal implementation.
+    ///
+    /// Only states that own their Lua session carry an implementation object;
+    /// borrowed states leave this empty.
     std::tr1::shared_ptr< impl > _pimpl;
 
+    /// The raw Lua state all the wrappers operate on.
+    ///
+    /// Keeping this outside of the implementation object makes a borrowed
+    /// state a cheap handle: constructing one (as happens on every call from
+    /// Lua into C++) does not touch the heap.
+    lua_State* _lua_state;
+
+    /// Whether this object is the one handed to the callable of protect().
+    ///
+    /// Inside a protected region any Lua error is already captured by the
+    /// enclosing lua_pcall, so the wrappers that would otherwise run their own
+    /// lua_pcall call the raw Lua C API directly.
+    bool _protected_region;
+
     void* new_userdata_voidp(const size_t);
     void* to_userdata_voidp(const int);
     void* check_userdata_voidp(const int narg, const std::string& name);
@@ -94,6 +127,9 @@ class state {
 
     void* raw_state(void);
 
+    void protect_voidp(void (*)(state&, void*), void*, const int, const int);
+    template< typename Callable > static void call_protected(state&, void*);
+
 public:
     state(void);
     explicit state(void*);
@@ -119,6 +155,7 @@ public:
     void load_file(const std::string&);
     void load_string(const std::string&);
     void new_table(void);
+    void new_table(const int, const int);
     template< typename Type > Type* new_userdata(void);
 	void * new_thread(void);
     bool next(const int = -2);
@@ -126,8 +163,11 @@ public:
     void open_string(void);
     void open_table(void);
     void pcall(const int, const int, const int);
+    template< typename Callable > void protect(Callable, const int = 0,
+                                               const int = 0);
     void pop(const int);
     void push_boolean(const bool);
+    void push_c_function(c_function);
     void push_cxx_closure(cxx_function, const int);
     void push_cxx_function(cxx_function);
     void push_integer(const int);
@@ -138,6 +178,16 @@ public:
     void push_value(const int = -1);
     void raw_get(const int = -2);
     void raw_set(const int = -3);
+    void raw_get_global(const std::string&);
+    void raw_set_global(const std::string&);
+    void raw_get_field(const int, const std::string&);
+    void raw_set_field(const int, const std::string&);
+    void raw_set_field(const std::string&, const double, const int = -3);
+    void raw_set_field(const std::string&, const int, const int = -3);
+    void raw_set_field(const std::string&, const char*, const int = -3);
+    void raw_set_field(const std::string&, const std::string&, const int = -3);
+    void raw_set_field(const std::string&, const bool, const int = -3);
+    bool raw_next(const int = -2);
 	
 	void concat(const int);
     void set_global(const std::string&);
@@ -148,6 +198,7 @@ public:
     template< typename Type > Type* to_userdata(const int = -1);
     std::string to_string(const int = -1);
 	std::string to_lstring(const int = -1);
+	string_ref to_string_ref(const int = -1);
     int upvalue_index(const int);
 
 	void findLib(const std::string& name, const int size, const int nup=0);
@@ -161,7 +212,14 @@ public:
 	void set_field(const std::string& name, const bool value, const int index=-3);
 	void set_field(const int index, const std::string& name);
 	void get_field(const int index, const std::string& name);
+	void push_key(const key& k);
+	void get_field(const int index, const key& k);
+	void set_field(const int index, const key& k);
+	void raw_get_field(const int index, const key& k);
+	void raw_set_field(const int index, const key& k);
 	template<typename T> T get_array(const int table_index, const int index);
+	template<typename T> std::vector<T> to_vector(const int index);
+	template<typename T> void push_vector(const std::vector<T>& values);
 	
 	void push_number(const double value);
 	const double to_number(const int);
@@ -170,9 +228,11 @@ public:
 	void replace(const int);
 
 	bool new_metatable(const std::string&);
+	bool new_metatable(const std::string&, const int);
 	void get_metatable(const std::string&);
 	template< typename Type > Type* check_userdata(const int, const std::string&);
 	void * getLuaState();
+	void * getMainLuaState();
 	void error(const std::string&);
 	void error(const char * fmt, ...);
 	void push_fstring(const char * fmt, ...);
@@ -68,6 +68,55 @@ state::check_userdata(const int narg, const std::string& name){
 	return static_cast< Type *>(check_userdata_voidp(narg, name));
 }
 
+
+/// Runs a C++ callable inside a single protected call.
+///
+/// The callable is invoked as callable(state&) with a state object that marks
+/// a protected region: its get_global(), set_global(), get_table(),
+/// set_table(), next() and set_field() wrappers skip their own lua_pcall and
+/// operate on the stack directly, because any Lua error they raise is caught
+/// by the lua_pcall that encloses the whole region.  This makes a batch of
+/// such operations cost one protected call instead of one per operation.
+///
+/// The top nargs values of the stack are passed to the region, where they
+/// appear at indices 1 to nargs; whatever the callable leaves on the stack is
+/// returned, adjusted to nresults values, exactly as lua_pcall would do.
+///
+/// Errors are reported once, at the boundary of the region.  A C++ exception
+/// thrown by the callable is rethrown as is; a Lua error is thrown as an
+/// api_error.  In both cases the arguments have been popped and nothing else
+/// is left on the stack.
+///
+/// \warning A Lua error raised inside the region unwinds the callable with
+/// longjmp (unless Lua is built as C++), so the callable must not rely on the
+/// destructors of its local objects running in that case.
+///
+/// \param callable The callable to run.
+/// \param nargs The number of values from the stack to pass to the region.
+/// \param nresults The number of values to return, or -1 for all of them.
+///
+/// \throw api_error If a Lua error is raised inside the region.
+template< typename Callable >
+void
+state::protect(Callable callable, const int nargs, const int nresults)
+{
+    protect_voidp(&state::call_protected< Callable >, &callable, nargs,
+                  nresults);
+}
+
+
+/// Invokes the callable of protect() through its concrete type.
+///
+/// \param region The state object of the protected region.
+/// \param callable Pointer to the callable.
+template< typename Callable >
+void
+state::call_protected(state& region, void* callable)
+{
+    (*static_cast< Callable* >(callable))(region);
+}
+
+
 }  // namespace lutok
 
 #endif  // !defined(LUTOK_STATE_IPP)
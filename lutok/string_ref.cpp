@@ -0,0 +1,50 @@
+#include <cassert>
+
+#include <lua.hpp>
+
+#include "c_gate.hpp"
+#include "string_ref.hpp"
+#include "state.ipp"
+
+
+/// Anchors the string at the given stack index.
+///
+/// The string itself is left on the stack.  The guard keeps the main thread to
+/// release the reference, as the registry is shared by all threads and the
+/// thread the guard was created on may be collected first.
+///
+/// \pre The value at index is a string.
+///
+/// \param state_ The Lua state.
+/// \param index The stack index of the string.
+lutok::string_guard::string_guard(state& state_, const int index) :
+    _lua_state(static_cast< lua_State* >(state_.getMainLuaState()))
+{
+    lua_State* raw_state = state_c_gate(state_).c_state();
+    assert(lua_type(raw_state, index) == LUA_TSTRING);
+    lua_pushvalue(raw_state, index);
+    std::size_t size;
+    const char* data = lua_tolstring(raw_state, -1, &size);
+    _view = string_ref(data, size);
+    _reference = luaL_ref(raw_state, LUA_REGISTRYINDEX);
+}
+
+
+/// Takes over the reference of another guard, which is left empty.
+///
+/// \param other The guard to move from.
+lutok::string_guard::string_guard(string_guard&& other) :
+    _lua_state(other._lua_state),
+    _reference(other._reference),
+    _view(other._view)
+{
+    other._reference = LUA_NOREF;
+    other._view = string_ref();
+}
+
+
+/// Releases the reference, after which the string may be collected.
+lutok::string_guard::~string_guard(void)
+{
+    luaL_unref(_lua_state, LUA_REGISTRYINDEX, _reference);
+}
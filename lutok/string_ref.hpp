@@ -0,0 +1,148 @@
+/// \file string_ref.hpp
+/// Non-owning access to the contents of Lua strings.
+
+#if !defined(LUTOK_STRING_REF_HPP)
+#define LUTOK_STRING_REF_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+struct lua_State;
+
+namespace lutok {
+
+
+class state;
+
+
+/// A non-owning view of the bytes of a Lua string.
+///
+/// Lua strings are immutable and never move, so the view stays valid for as
+/// long as the string cannot be collected: typically while the value it was
+/// taken from remains on the stack, e.g. during the whole call for function
+/// arguments.  Use string_guard to keep a string alive beyond that.
+///
+/// The bytes may contain embedded zeros; Lua also guarantees a terminating zero
+/// after the last byte, so data() can be passed where a C string is expected.
+class string_ref {
+    /// Pointer to the first byte, owned by Lua.
+    const char* _data;
+
+    /// Number of bytes, not counting the terminating zero.
+    std::size_t _size;
+
+public:
+    /// Constructs an empty view.
+    string_ref(void) : _data(""), _size(0)
+    {
+    }
+
+    /// Constructs a view of size bytes starting at data.
+    string_ref(const char* data, const std::size_t size) :
+        _data(data), _size(size)
+    {
+    }
+
+    const char*
+    data(void) const
+    {
+        return _data;
+    }
+
+    std::size_t
+    size(void) const
+    {
+        return _size;
+    }
+
+    bool
+    empty(void) const
+    {
+        return _size == 0;
+    }
+
+    const char*
+    begin(void) const
+    {
+        return _data;
+    }
+
+    const char*
+    end(void) const
+    {
+        return _data + _size;
+    }
+
+    char
+    operator[](const std::size_t position) const
+    {
+        return _data[position];
+    }
+
+    /// Copies the bytes into a new string.
+    std::string
+    str(void) const
+    {
+        return std::string(_data, _size);
+    }
+
+    bool
+    operator==(const string_ref& other) const
+    {
+        return _size == other._size &&
+            std::memcmp(_data, other._data, _size) == 0;
+    }
+
+    bool
+    operator!=(const string_ref& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+
+/// A RAII model for a Lua string used outside of the stack.
+///
+/// The guard stores a reference to the string in the registry, so the string
+/// cannot be collected and its view stays valid until the guard is destroyed,
+/// even after the value has been popped or the call it was an argument of has
+/// returned.  The guard must not outlive the Lua state.
+///
+/// Use this class as follows:
+///
+/// string_guard payload(state, 1);
+/// queue.push_back(...payload.view()...);  // stays valid while payload lives
+class string_guard {
+    /// The main thread of the Lua state holding the reference.
+    lua_State* _lua_state;
+
+    /// The registry reference anchoring the string.
+    int _reference;
+
+    /// View of the anchored string.
+    string_ref _view;
+
+    /// Disallow copies.
+    string_guard(const string_guard&);
+
+    /// Disallow assignment.
+    string_guard& operator=(const string_guard&);
+
+public:
+    string_guard(state&, const int);
+    string_guard(string_guard&&);
+    ~string_guard(void);
+
+    /// Returns the view of the guarded string.
+    const string_ref&
+    view(void) const
+    {
+        return _view;
+    }
+};
+
+
+}  // namespace lutok
+
+#endif  // !defined(LUTOK_STRING_REF_HPP)